@@ -1,4 +1,10 @@
+// Build with -DWS_TLS to serve wss:// instead of ws://
+#ifdef WS_TLS
+#include <websocketpp/config/asio.hpp>
+#include <openssl/ssl.h>
+#else
 #include <websocketpp/config/asio_no_tls.hpp>
+#endif
 #include <websocketpp/server.hpp>
 #include <websocketpp/common/thread.hpp>
 #include <mysql/mysql.h>
@@ -8,12 +14,34 @@
 #include "rapidjson/stringbuffer.h"
 
 #include <iostream>
+#include <sstream>
 #include <set>
+#include <map>
+#include <vector>
 #include <string>
 #include <random>
 #include <tuple>
+#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <ctime>
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#ifdef WS_TLS
+typedef websocketpp::server<websocketpp::config::asio_tls> server;
+typedef websocketpp::lib::shared_ptr<websocketpp::lib::asio::ssl::context> context_ptr;
+#else
 typedef websocketpp::server<websocketpp::config::asio> server;
+#endif
 
 using websocketpp::connection_hdl;
 using websocketpp::lib::placeholders::_1;
@@ -28,83 +56,2363 @@ using websocketpp::lib::condition_variable;
 
 using namespace rapidjson;
 
+/* Leveled asynchronous logging. Levels below LOG_MIN_LEVEL are compiled
+ * out, so build with -DLOG_MIN_LEVEL=0 to get debug output. Each thread
+ * appends to its own ring that a background writer drains to stdout; when
+ * a ring is full the line is dropped and counted instead of blocking.
+ * A ring is retired when its thread exits and freed after its last drain.
+ * Error lines are rate limited per call site.
+ */
+
+enum log_level {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_ERROR
+};
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 1
+#endif
+
+struct log_line {
+    int level;
+    time_t time;
+    std::string text;
+};
+
+class log_ring {
+    /*
+    Single producer, single consumer ring of log lines: the owning thread
+    pushes, the writer thread pops
+    */
+public:
+    static const size_t capacity = 1024;
+
+    log_ring() : m_head(0), m_tail(0), m_retired(false) {}
+
+    void retire(){
+        // called by the owning thread after its last push
+        m_retired.store(true, std::memory_order_release);
+    }
+
+    bool retired() const {
+        return m_retired.load(std::memory_order_acquire);
+    }
+
+    bool push(int level, const std::string& text){
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if(head - m_tail.load(std::memory_order_acquire) == capacity){
+            return false;
+        }
+        log_line& line = m_lines[head % capacity];
+        line.level = level;
+        line.time = time(NULL);
+        line.text = text;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(log_line& line){
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if(tail == m_head.load(std::memory_order_acquire)){
+            return false;
+        }
+        line.level = m_lines[tail % capacity].level;
+        line.time = m_lines[tail % capacity].time;
+        line.text.swap(m_lines[tail % capacity].text);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::atomic<size_t> m_head;
+    std::atomic<size_t> m_tail;
+    std::atomic<bool> m_retired;
+    log_line m_lines[capacity];
+};
+
+class async_logger {
+public:
+    static async_logger& instance(){
+        static async_logger logger;
+        return logger;
+    }
+
+    void write(int level, const std::string& text){
+        if(!thread_ring().push(level, text)){
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    ~async_logger(){
+        m_running.store(false);
+        m_writer.join();
+        drain();
+    }
+
+private:
+    async_logger() : m_running(true), m_dropped(0) {
+        m_writer = thread(bind(&async_logger::writer_loop, this));
+    }
+
+    struct ring_owner {
+        // retires the ring of a thread when the thread exits
+        ring_owner() : ring(NULL) {}
+        ~ring_owner(){
+            if(ring != NULL){
+                ring->retire();
+            }
+        }
+        log_ring* ring;
+    };
+
+    log_ring& thread_ring(){
+        // rings are registered on the first line a thread logs
+        static thread_local ring_owner owner;
+        if(owner.ring == NULL){
+            lock_guard<mutex> guard(m_rings_lock);
+            owner.ring = new log_ring();
+            m_rings.push_back(owner.ring);
+        }
+        return *owner.ring;
+    }
+
+    bool drain(){
+        static const char* names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+        std::string buffer;
+        log_line line;
+        {
+            lock_guard<mutex> guard(m_rings_lock);
+            for(size_t i=0; i<m_rings.size(); ){
+                // checked before popping, so a retired ring is empty after it
+                bool retired = m_rings[i]->retired();
+                while(m_rings[i]->pop(line)){
+                    char stamp[32];
+                    struct tm local;
+                    localtime_r(&line.time, &local);
+                    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+                    buffer += std::string("[") + stamp + "] " + names[line.level] + " " + line.text + "\n";
+                }
+                if(retired){
+                    delete m_rings[i];
+                    m_rings[i] = m_rings.back();
+                    m_rings.pop_back();
+                }
+                else{
+                    i++;
+                }
+            }
+        }
+        long dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+        if(dropped > 0){
+            buffer += "WARNING " + std::to_string(dropped) + " log lines dropped\n";
+        }
+        if(buffer.empty()){
+            return false;
+        }
+        fwrite(buffer.data(), 1, buffer.size(), stdout);
+        fflush(stdout);
+        return true;
+    }
+
+    void writer_loop(){
+        while(m_running.load()){
+            if(!drain()){
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        }
+    }
+
+    std::atomic<bool> m_running;
+    std::atomic<long> m_dropped;
+    std::vector<log_ring*> m_rings;
+    mutex m_rings_lock;
+    thread m_writer;
+};
+
+class log_rate_limit {
+    /*
+    Allows at most max_per_second lines per second from one call site and
+    counts the rest so the next line that gets through can report them
+    */
+public:
+    static const long max_per_second = 10;
+
+    log_rate_limit() : m_second(0), m_count(0), m_suppressed(0) {}
+
+    bool allow(){
+        time_t now = time(NULL);
+        if(m_second.exchange(now, std::memory_order_relaxed) != now){
+            m_count.store(0, std::memory_order_relaxed);
+        }
+        if(m_count.fetch_add(1, std::memory_order_relaxed) < max_per_second){
+            return true;
+        }
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::string suppressed_suffix(){
+        long suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+        return suppressed ? " (" + std::to_string(suppressed) + " similar lines suppressed)" : "";
+    }
+
+private:
+    std::atomic<time_t> m_second;
+    std::atomic<long> m_count;
+    std::atomic<long> m_suppressed;
+};
+
+#define LOG_AT(level, message) do { \
+        std::ostringstream log_stream__; \
+        log_stream__ << message; \
+        async_logger::instance().write(level, log_stream__.str()); \
+    } while(0)
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(message) LOG_AT(LOG_LEVEL_DEBUG, message)
+#else
+#define LOG_DEBUG(message) do {} while(0)
+#endif
+
+#if LOG_MIN_LEVEL <= 1
+#define LOG_INFO(message) LOG_AT(LOG_LEVEL_INFO, message)
+#else
+#define LOG_INFO(message) do {} while(0)
+#endif
+
+#if LOG_MIN_LEVEL <= 2
+#define LOG_WARNING(message) LOG_AT(LOG_LEVEL_WARNING, message)
+#else
+#define LOG_WARNING(message) do {} while(0)
+#endif
+
+#define LOG_ERROR(message) do { \
+        static log_rate_limit log_rate_limit__; \
+        if (log_rate_limit__.allow()) { \
+            LOG_AT(LOG_LEVEL_ERROR, message << log_rate_limit__.suppressed_suffix()); \
+        } \
+    } while(0)
+
+
+/* on_open insert connection_hdl into the connection registry
+ * on_close remove connection_hdl from the connection registry
+ * on_message queue the request for the worker threads, one request per
+ * connection at a time so each connection is answered in order
+ */
+
+enum action_type {
+    MESSAGE
+};
+
+struct action {
+    action(action_type t, connection_hdl h) : type(t), hdl(h), trace_id(0) {}
+    action(action_type t, connection_hdl h, server::message_ptr m, uint64_t trace)
+      : type(t), hdl(h), msg(m), trace_id(trace) {}
+
+    action_type type;
+    websocketpp::connection_hdl hdl;
+    server::message_ptr msg;
+    uint64_t trace_id;
+};
+
+enum trace_phase {
+    TRACE_RECEIVED,
+    TRACE_DEQUEUED,
+    TRACE_PARSED,
+    TRACE_QUERY_START,
+    TRACE_QUERY_END,
+    TRACE_HANDLED,
+    TRACE_SENT
+};
+
+struct trace_event {
+    // 64 bytes, one cache line per event
+    uint64_t trace_id;
+    uint64_t timestamp_ns;
+    uint32_t phase;
+    uint32_t thread_index;
+    char action[40];
+};
+
+static_assert(sizeof(trace_event) == 64, "trace_event is stored as 8 words");
+
+class trace_ring {
+    /*
+    Fixed size ring of trace events written by a single thread. The writer
+    never blocks: it overwrites the oldest slot and publishes the new head
+    with a release store. Each slot is a seqlock: its sequence is odd while
+    the event at index n is being written (2n+1) and 2n+2 once it is
+    complete, so a concurrent dump skips slots that are torn or were
+    overwritten by a newer lap. The event is stored as relaxed atomic
+    words, which keeps the concurrent reads free of data races.
+    */
+public:
+    static const size_t capacity = 8192;
+
+    explicit trace_ring(uint32_t thread_index) : m_thread_index(thread_index), m_head(0) {
+        for(size_t i=0; i<capacity; i++){
+            m_slots[i].sequence.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(const trace_event& event){
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        slot& target = m_slots[head % capacity];
+        trace_event stamped = event;
+        stamped.thread_index = m_thread_index;
+        uint64_t words[slot_words];
+        memcpy(words, &stamped, sizeof(words));
+
+        target.sequence.store(2 * head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for(size_t i=0; i<slot_words; i++){
+            target.words[i].store(words[i], std::memory_order_relaxed);
+        }
+        target.sequence.store(2 * head + 2, std::memory_order_release);
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    void copy_to(std::vector<trace_event>& events) const {
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        uint64_t first = head > capacity ? head - capacity : 0;
+        for(uint64_t i=first; i<head; i++){
+            const slot& source = m_slots[i % capacity];
+            if(source.sequence.load(std::memory_order_acquire) != 2 * i + 2){
+                continue;
+            }
+            uint64_t words[slot_words];
+            for(size_t word=0; word<slot_words; word++){
+                words[word] = source.words[word].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(source.sequence.load(std::memory_order_relaxed) != 2 * i + 2){
+                continue;
+            }
+            trace_event event;
+            memcpy(&event, words, sizeof(event));
+            events.push_back(event);
+        }
+    }
+
+private:
+    static const size_t slot_words = sizeof(trace_event) / sizeof(uint64_t);
+
+    struct slot {
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> words[slot_words];
+    };
+
+    uint32_t m_thread_index;
+    std::atomic<uint64_t> m_head;
+    slot m_slots[capacity];
+};
+
+class request_tracer {
+    /*
+    Samples one request in every sample_rate and timestamps it at each phase
+    into a ring owned by the recording thread, so tracing takes no lock on
+    the hot path. A request that is not sampled has trace id 0 and costs a
+    single branch per phase.
+    */
+public:
+    request_tracer() : m_next_id(1), m_sample_rate(0) {}
+
+    void set_sample_rate(long sample_rate){
+        m_sample_rate.store(sample_rate < 0 ? 0 : sample_rate, std::memory_order_relaxed);
+    }
+
+    long sample_rate() const {
+        return m_sample_rate.load(std::memory_order_relaxed);
+    }
+
+    uint64_t start_request(){
+        // returns the trace id of a sampled request or 0
+        long sample_rate = m_sample_rate.load(std::memory_order_relaxed);
+        if(sample_rate <= 0){
+            return 0;
+        }
+        uint64_t id = m_next_id.fetch_add(1, std::memory_order_relaxed);
+        return id % sample_rate == 0 ? id : 0;
+    }
+
+    void record(uint64_t trace_id, trace_phase phase, const char* action_name = ""){
+        if(trace_id == 0){
+            return;
+        }
+        trace_event event;
+        event.trace_id = trace_id;
+        event.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        event.phase = phase;
+        strncpy(event.action, action_name, sizeof(event.action) - 1);
+        event.action[sizeof(event.action) - 1] = '\0';
+        thread_ring().record(event);
+    }
+
+    std::vector<trace_event> events(){
+        std::vector<trace_event> events;
+        lock_guard<mutex> guard(m_rings_lock);
+        for(size_t i=0; i<m_rings.size(); i++){
+            m_rings[i]->copy_to(events);
+        }
+        return events;
+    }
+
+    static bool write_binary(const std::string& path, const std::vector<trace_event>& events){
+        /*
+        Function to write events as "UMTRACE1", a uint64 event count and the
+        raw trace_event records
+        */
+        FILE* file = fopen(path.c_str(), "wb");
+        if(file == NULL){
+            return false;
+        }
+        uint64_t count = events.size();
+        bool written = fwrite("UMTRACE1", 1, 8, file) == 8 &&
+            fwrite(&count, sizeof(count), 1, file) == 1 &&
+            (events.empty() || fwrite(&events[0], sizeof(trace_event), events.size(), file) == events.size());
+        return fclose(file) == 0 && written;
+    }
+
+    static bool write_chrome_trace(const std::string& path, std::vector<trace_event> events){
+        /*
+        Function to write events in the Chrome trace event format. Every pair
+        of consecutive phases of a request becomes one complete ("X") event
+        named after the phase it ends in.
+        */
+        static const char* names[] = {"received", "queue wait", "parse", "handler", "query", "handler", "send"};
+        std::sort(events.begin(), events.end(), trace_event_order);
+
+        FILE* file = fopen(path.c_str(), "w");
+        if(file == NULL){
+            return false;
+        }
+        fputs("{\"traceEvents\":[", file);
+        bool first = true;
+        std::string action_name;
+        std::string escaped_name;
+        for(size_t i=1; i<events.size(); i++){
+            const trace_event& begin = events[i-1];
+            const trace_event& end = events[i];
+            if(begin.trace_id != end.trace_id){
+                action_name = "";
+                escaped_name = "";
+                continue;
+            }
+            if(end.action[0] != '\0'){
+                action_name = end.action;
+                escaped_name = json_escape(action_name);
+            }
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%llu}}",
+                first ? "" : ",\n", names[end.phase], escaped_name.c_str(), end.thread_index,
+                begin.timestamp_ns / 1000.0, (end.timestamp_ns - begin.timestamp_ns) / 1000.0,
+                static_cast<unsigned long long>(end.trace_id));
+            first = false;
+        }
+        fputs("]}\n", file);
+        return fclose(file) == 0;
+    }
+
+private:
+    static std::string json_escape(const std::string& text){
+        // action names come from clients and may contain any byte
+        std::string escaped;
+        for(size_t i=0; i<text.size(); i++){
+            unsigned char c = text[i];
+            if(c == '"' || c == '\\'){
+                escaped += '\\';
+                escaped += c;
+            }
+            else if(c < 0x20){
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                escaped += code;
+            }
+            else{
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    static bool trace_event_order(const trace_event& a, const trace_event& b){
+        if(a.trace_id != b.trace_id){
+            return a.trace_id < b.trace_id;
+        }
+        return a.timestamp_ns < b.timestamp_ns;
+    }
+
+    trace_ring& thread_ring(){
+        // rings are registered once per thread and never freed
+        static thread_local trace_ring* ring = NULL;
+        if(ring == NULL){
+            lock_guard<mutex> guard(m_rings_lock);
+            ring = new trace_ring(m_rings.size());
+            m_rings.push_back(ring);
+        }
+        return *ring;
+    }
+
+    std::atomic<uint64_t> m_next_id;
+    std::atomic<long> m_sample_rate;
+    std::vector<trace_ring*> m_rings;
+    mutex m_rings_lock;
+};
+
+long env_or_default(const char* name, long default_value){
+    /*
+    Function to read a numeric setting from the environment
+    return: the value of name, or default_value when unset or not a number
+    */
+    const char* value = std::getenv(name);
+    if(value == NULL || *value == '\0'){
+        return default_value;
+    }
+    char* end;
+    long parsed = std::strtol(value, &end, 10);
+    return *end == '\0' ? parsed : default_value;
+}
+
+bool parse_id(const std::string& text, std::string& id){
+    /*
+    Function to turn a row id sent by a client into the form MySQL returns
+    it in, so "7", " 7 " and "007" all key the indexes as "7"
+    return: false when text is not a non-negative integer
+    */
+    size_t first = text.find_first_not_of(' ');
+    size_t last = text.find_last_not_of(' ');
+    if(first == std::string::npos){
+        return false;
+    }
+    std::string digits = text.substr(first, last - first + 1);
+    if(digits.size() > 20 || digits.find_first_not_of("0123456789") != std::string::npos){
+        return false;
+    }
+    errno = 0;
+    unsigned long long value = std::strtoull(digits.c_str(), NULL, 10);
+    if(errno != 0){
+        return false;
+    }
+    id = std::to_string(value);
+    return true;
+}
+
+bool parse_unsigned(const rapidjson::Value& value, unsigned long max_value, unsigned long& parsed){
+    /*
+    Function to read a non-negative number sent by a client, either as a
+    JSON number or as a string of digits
+    return: false when value is not such a number or exceeds max_value
+    */
+    if(value.IsUint64()){
+        parsed = value.GetUint64();
+        return parsed <= max_value;
+    }
+    if(!value.IsString() || !std::isdigit(static_cast<unsigned char>(value.GetString()[0]))){
+        return false;
+    }
+    char* end;
+    errno = 0;
+    parsed = std::strtoul(value.GetString(), &end, 10);
+    return *end == '\0' && errno == 0 && parsed <= max_value;
+}
+
+int64_t steady_now_ms(){
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+enum outbound_kind {
+    OUTBOUND_REPLY,
+    OUTBOUND_NOTIFICATION
+};
+
+enum enqueue_result {
+    ENQUEUE_FLUSH,          // queued, caller must schedule a flush
+    ENQUEUE_QUEUED,         // queued behind a flush that is already scheduled
+    ENQUEUE_DROPPED,        // notification dropped, the peer is over the soft limit
+    ENQUEUE_OVER_LIMIT,     // peer is over the hard limit and must be disconnected
+    ENQUEUE_CLOSED          // connection is no longer registered
+};
+
+struct outbound_message {
+    websocketpp::lib::shared_ptr<const std::string> payload;
+    websocketpp::frame::opcode::value opcode;
+    uint64_t trace_id;
+};
+
+struct connection_state {
+    std::string session;
+    int in_flight;
+    int64_t last_activity_ms;
+    int64_t last_seen_ms;
+    int64_t last_write_ms;
+    std::vector<outbound_message> outbound;
+    size_t outbound_bytes;
+    bool flush_scheduled;
+    std::queue<action> pending;     // requests waiting behind the running one
+    bool busy;                      // a worker is handling a request of this connection
+};
+
+class connection_registry {
+    /*
+    Registry of open connections split into independently locked shards, so
+    open, close and message bookkeeping on different connections never
+    contend on a single lock. The shard is picked from the address of the
+    connection object, which stays valid from on_open until on_close returns.
+    last_activity_ms is refreshed by client messages only; last_seen_ms is
+    also refreshed by pongs and tells live idle peers apart from dead ones.
+    */
+public:
+    typedef std::vector<connection_hdl> hdl_list;
+
+    void add(connection_hdl hdl){
+        shard& s = shard_for(hdl);
+        connection_state state;
+        state.in_flight = 0;
+        state.last_activity_ms = state.last_seen_ms = steady_now_ms();
+        state.last_write_ms = 0;
+        state.outbound_bytes = 0;
+        state.flush_scheduled = false;
+        state.busy = false;
+        lock_guard<mutex> guard(s.lock);
+        s.connections[hdl] = state;
+    }
+
+    void remove(connection_hdl hdl){
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        s.connections.erase(hdl);
+    }
+
+    bool begin_request(connection_hdl hdl){
+        // returns false when the connection is no longer registered
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it == s.connections.end()){
+            return false;
+        }
+        it->second.in_flight++;
+        it->second.last_activity_ms = it->second.last_seen_ms = steady_now_ms();
+        return true;
+    }
+
+    void end_request(connection_hdl hdl){
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it != s.connections.end() && it->second.in_flight > 0){
+            it->second.in_flight--;
+        }
+    }
+
+    bool queue_request(connection_hdl hdl, const action& a){
+        /*
+        Function to order the requests of a connection. Returns true when
+        no request of the connection is running, the caller then hands a to
+        a worker; otherwise a waits until next_request returns it.
+        */
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it == s.connections.end()){
+            return false;
+        }
+        if(!it->second.busy){
+            it->second.busy = true;
+            return true;
+        }
+        it->second.pending.push(a);
+        return false;
+    }
+
+    bool next_request(connection_hdl hdl, action& next){
+        /*
+        Function called when a request of the connection is done. Returns
+        the next waiting request, or marks the connection idle when there
+        is none.
+        */
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it == s.connections.end()){
+            return false;
+        }
+        if(it->second.pending.empty()){
+            it->second.busy = false;
+            return false;
+        }
+        next = it->second.pending.front();
+        it->second.pending.pop();
+        return true;
+    }
+
+    void touch(connection_hdl hdl){
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it != s.connections.end()){
+            it->second.last_seen_ms = steady_now_ms();
+        }
+    }
+
+    void set_session(connection_hdl hdl, const std::string& session){
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it != s.connections.end()){
+            it->second.session = session;
+        }
+    }
+
+    void note_write(connection_hdl hdl){
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it != s.connections.end()){
+            it->second.last_write_ms = steady_now_ms();
+        }
+    }
+
+    bool wrote_within(connection_hdl hdl, int64_t window_ms){
+        // true when the connection made a successful write in the last window_ms
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        return it != s.connections.end() && it->second.last_write_ms != 0 &&
+            steady_now_ms() - it->second.last_write_ms < window_ms;
+    }
+
+    enqueue_result enqueue(connection_hdl hdl, const outbound_message& message, outbound_kind kind,
+            size_t transport_bytes, size_t soft_limit, size_t hard_limit){
+        /*
+        Function to queue a message for the next flush of the connection.
+        transport_bytes is what websocketpp still holds for the peer; together
+        with the queued bytes it decides the slow consumer policy: past
+        soft_limit notifications are dropped, past hard_limit the connection
+        must be closed.
+        */
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it == s.connections.end()){
+            return ENQUEUE_CLOSED;
+        }
+        connection_state& state = it->second;
+        size_t pending = state.outbound_bytes + transport_bytes;
+        // a single large reply to a drained connection is always let through
+        if(pending > 0 && pending + message.payload->size() > hard_limit){
+            state.outbound.clear();
+            state.outbound_bytes = 0;
+            return ENQUEUE_OVER_LIMIT;
+        }
+        if(kind == OUTBOUND_NOTIFICATION && pending > soft_limit){
+            return ENQUEUE_DROPPED;
+        }
+        state.outbound.push_back(message);
+        state.outbound_bytes += message.payload->size();
+        if(state.flush_scheduled){
+            return ENQUEUE_QUEUED;
+        }
+        state.flush_scheduled = true;
+        return ENQUEUE_FLUSH;
+    }
+
+    void take_outbound(connection_hdl hdl, std::vector<outbound_message>& messages){
+        // hands every queued message to the flush and clears the queue. The
+        // flush stays scheduled until finish_flush, so messages queued while
+        // it sends wait for it instead of starting a flush of their own
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it != s.connections.end()){
+            messages.swap(it->second.outbound);
+            it->second.outbound_bytes = 0;
+        }
+    }
+
+    bool finish_flush(connection_hdl hdl){
+        // returns true when messages were queued during the flush, the
+        // caller must then flush again; otherwise the flush is over
+        shard& s = shard_for(hdl);
+        lock_guard<mutex> guard(s.lock);
+        state_map::iterator it = s.connections.find(hdl);
+        if(it == s.connections.end()){
+            return false;
+        }
+        if(it->second.outbound.empty()){
+            it->second.flush_scheduled = false;
+            return false;
+        }
+        return true;
+    }
+
+    void sweep(int64_t ping_after_ms, int64_t idle_after_ms, hdl_list& to_ping, hdl_list& to_evict){
+        /*
+        Function to collect connections that have been silent for
+        ping_after_ms (to_ping) and connections without a request in flight
+        that sent no message for idle_after_ms (to_evict, 0 disables)
+        Each shard is locked on its own while it is scanned.
+        */
+        int64_t now = steady_now_ms();
+        for(size_t i=0; i<shard_count; i++){
+            lock_guard<mutex> guard(m_shards[i].lock);
+            state_map& connections = m_shards[i].connections;
+            for(state_map::iterator it = connections.begin(); it != connections.end(); ++it){
+                if(idle_after_ms > 0 && it->second.in_flight == 0 && now - it->second.last_activity_ms >= idle_after_ms){
+                    to_evict.push_back(it->first);
+                }
+                else if(now - it->second.last_seen_ms >= ping_after_ms){
+                    to_ping.push_back(it->first);
+                }
+            }
+        }
+    }
+
+    void connections(hdl_list& hdls){
+        for(size_t i=0; i<shard_count; i++){
+            lock_guard<mutex> guard(m_shards[i].lock);
+            for(state_map::const_iterator it = m_shards[i].connections.begin(); it != m_shards[i].connections.end(); ++it){
+                hdls.push_back(it->first);
+            }
+        }
+    }
+
+    void sessions(hdl_list& hdls){
+        // connections that are logged in
+        for(size_t i=0; i<shard_count; i++){
+            lock_guard<mutex> guard(m_shards[i].lock);
+            for(state_map::const_iterator it = m_shards[i].connections.begin(); it != m_shards[i].connections.end(); ++it){
+                if(!it->second.session.empty()){
+                    hdls.push_back(it->first);
+                }
+            }
+        }
+    }
+
+    size_t size(){
+        size_t total = 0;
+        for(size_t i=0; i<shard_count; i++){
+            lock_guard<mutex> guard(m_shards[i].lock);
+            total += m_shards[i].connections.size();
+        }
+        return total;
+    }
+
+private:
+    typedef std::map<connection_hdl, connection_state, std::owner_less<connection_hdl> > state_map;
+
+    static const size_t shard_count = 64;
+
+    struct shard {
+        mutex lock;
+        state_map connections;
+    };
+
+    shard& shard_for(connection_hdl hdl){
+        size_t key = reinterpret_cast<size_t>(hdl.lock().get());
+        // connection objects are heap allocated, so drop the alignment bits
+        return m_shards[(key >> 4) % shard_count];
+    }
+
+    shard m_shards[shard_count];
+};
+
+struct db_endpoint {
+    std::string host;
+    unsigned int port;
+};
+
+struct replica_state {
+    replica_state() : lag_s(-1), monitor(NULL) {}
+
+    db_endpoint endpoint;
+    std::atomic<long> lag_s;    // -1 while unreachable or not replicating
+    MYSQL* monitor;             // used by the lag monitor thread only
+};
+
+class db_router {
+    /*
+    Hands out MySQL connections to the primary for writes and to a replica
+    for reads. Replicas are picked round robin among those whose measured
+    replication lag is within max_lag_s; reads fall back to the primary when
+    no replica qualifies or the replica refuses the connection.
+    Endpoints are read from the environment:
+        WS_DB_PRIMARY   host[:port] of the primary (default localhost)
+        WS_DB_REPLICAS  comma separated host[:port] list (default none)
+        WS_DB_USER, WS_DB_PASSWORD, WS_DB_NAME
+        WS_DB_MAX_REPLICA_LAG_S  (default 5)
+    */
+public:
+    db_router() : m_next_replica(0) {
+        m_user = env_string_or_default("WS_DB_USER", "root");
+        m_password = env_string_or_default("WS_DB_PASSWORD", "password");
+        m_database = env_string_or_default("WS_DB_NAME", "demo");
+        m_primary = parse_endpoint(env_string_or_default("WS_DB_PRIMARY", "localhost"));
+        m_max_lag_s = env_or_default("WS_DB_MAX_REPLICA_LAG_S", 5);
+
+        std::string replicas = env_string_or_default("WS_DB_REPLICAS", "");
+        size_t start = 0;
+        while(start < replicas.size()){
+            size_t end = replicas.find(',', start);
+            if(end == std::string::npos){
+                end = replicas.size();
+            }
+            if(end > start){
+                websocketpp::lib::shared_ptr<replica_state> replica(new replica_state());
+                replica->endpoint = parse_endpoint(replicas.substr(start, end - start));
+                m_replicas.push_back(replica);
+            }
+            start = end + 1;
+        }
+    }
+
+    MYSQL* connect_primary(){
+        return connect(m_primary);
+    }
+
+    MYSQL* connect_replica(){
+        // returns a primary connection when no replica is usable
+        for(size_t attempt=0; attempt<m_replicas.size(); attempt++){
+            replica_state& replica = *m_replicas[m_next_replica.fetch_add(1, std::memory_order_relaxed) % m_replicas.size()];
+            long lag = replica.lag_s.load(std::memory_order_relaxed);
+            if(lag < 0 || lag > m_max_lag_s){
+                continue;
+            }
+            MYSQL* conn = connect(replica.endpoint);
+            if(conn != NULL){
+                return conn;
+            }
+            replica.lag_s.store(-1, std::memory_order_relaxed);
+        }
+        return connect_primary();
+    }
+
+    bool kill_query(const std::string& host, unsigned int port, unsigned long thread_id){
+        /*
+        Function to cancel the statement running on a connection through a
+        side connection to the same server
+        */
+        db_endpoint endpoint;
+        endpoint.host = host;
+        endpoint.port = port;
+        MYSQL* conn = connect(endpoint);
+        if(conn == NULL){
+            return false;
+        }
+        bool killed = mysql_query(conn, ("KILL QUERY " + std::to_string(thread_id)).c_str()) == 0;
+        mysql_close(conn);
+        return killed;
+    }
+
+    bool has_replicas() const {
+        return !m_replicas.empty();
+    }
+
+    void monitor_lag(){
+        /*
+        Function to refresh the replication lag of every replica from
+        SHOW REPLICA STATUS (SHOW SLAVE STATUS on older servers)
+        */
+        for(size_t i=0; i<m_replicas.size(); i++){
+            replica_state& replica = *m_replicas[i];
+            if(replica.monitor == NULL){
+                replica.monitor = connect(replica.endpoint);
+            }
+            long lag = replica.monitor ? read_lag(replica.monitor) : -1;
+            if(lag < 0 && replica.monitor){
+                mysql_close(replica.monitor);
+                replica.monitor = NULL;
+            }
+            if(lag != replica.lag_s.exchange(lag, std::memory_order_relaxed) && lag < 0){
+                LOG_WARNING("replica " << replica.endpoint.host << ":" << replica.endpoint.port << " is unavailable for reads");
+            }
+        }
+    }
+
+    long stale_read_window_ms() const {
+        /*
+        Function to bound how long after a write a replica read may still
+        miss it: the lag limit, plus a second because lag is reported in
+        whole seconds, plus the monitor interval the measurement may be
+        behind by
+        */
+        return m_replicas.empty() ? 0 : (m_max_lag_s + 2) * 1000;
+    }
+
+    void monitor_loop(){
+        while(1){
+            monitor_lag();
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+
+private:
+    static std::string env_string_or_default(const char* name, const char* default_value){
+        const char* value = std::getenv(name);
+        return value ? value : default_value;
+    }
+
+    static db_endpoint parse_endpoint(const std::string& address){
+        db_endpoint endpoint;
+        size_t colon = address.rfind(':');
+        endpoint.host = address.substr(0, colon);
+        endpoint.port = colon == std::string::npos ? 0 : std::strtoul(address.c_str() + colon + 1, NULL, 10);
+        return endpoint;
+    }
+
+    MYSQL* connect(const db_endpoint& endpoint){
+        MYSQL* conn = mysql_init(NULL);
+        if(mysql_real_connect(conn, endpoint.host.c_str(), m_user.c_str(), m_password.c_str(), m_database.c_str(), endpoint.port, NULL, CLIENT_FOUND_ROWS) == NULL){
+            LOG_ERROR("could not connect to " << endpoint.host << ":" << endpoint.port << ": " << mysql_error(conn));
+            mysql_close(conn);
+            return NULL;
+        }
+        return conn;
+    }
+
+    static long read_lag(MYSQL* conn){
+        if(mysql_query(conn, "SHOW REPLICA STATUS") != 0 && mysql_query(conn, "SHOW SLAVE STATUS") != 0){
+            return -1;
+        }
+        MYSQL_RES* res = mysql_store_result(conn);
+        if(res == NULL){
+            return -1;
+        }
+        long lag = -1;
+        MYSQL_ROW row = mysql_fetch_row(res);
+        if(row != NULL){
+            MYSQL_FIELD* fields = mysql_fetch_fields(res);
+            for(unsigned int i=0; i<mysql_num_fields(res); i++){
+                std::string name = fields[i].name;
+                if((name == "Seconds_Behind_Source" || name == "Seconds_Behind_Master") && row[i] != NULL){
+                    lag = std::strtol(row[i], NULL, 10);
+                }
+            }
+        }
+        mysql_free_result(res);
+        return lag;
+    }
+
+    db_endpoint m_primary;
+    std::vector<websocketpp::lib::shared_ptr<replica_state> > m_replicas;
+    std::atomic<size_t> m_next_replica;
+    std::string m_user;
+    std::string m_password;
+    std::string m_database;
+    long m_max_lag_s;
+};
+
+struct deadline_exceeded : public std::exception {
+    const char* what() const throw() {
+        return "deadline exceeded";
+    }
+};
+
+struct tracked_connection {
+    MYSQL* conn;
+    std::string host;
+    unsigned int port;
+    unsigned long thread_id;
+};
+
+struct deadline_slot {
+    /*
+    Deadline state of the request a worker is running, shared between the
+    worker and the watchdog. deadline_ms is 0 while the worker is idle or
+    the action has no deadline.
+    */
+    deadline_slot() : deadline_ms(0), expired(false) {}
+
+    mutex lock;
+    std::string action;
+    int64_t deadline_ms;
+    bool expired;
+    std::vector<tracked_connection> connections;
+};
+
+class deadline_watchdog {
+    /*
+    Enforces per-action deadlines. Every worker owns a slot; the watchdog
+    thread scans the slots and, once a deadline passes, marks the slot
+    expired and sends KILL QUERY for every database connection the request
+    holds. The worker notices the expiry at its next database call and
+    unwinds with deadline_exceeded.
+    Deadlines come from the environment:
+        WS_DEFAULT_DEADLINE_MS  for every action (default 10000, 0 disables)
+        WS_ACTION_DEADLINES     overrides, e.g. "user_list=2000,log_in=500"
+    */
+public:
+    deadline_watchdog(){
+        m_default_ms = env_or_default("WS_DEFAULT_DEADLINE_MS", 10000);
+        const char* overrides = std::getenv("WS_ACTION_DEADLINES");
+        std::string list = overrides ? overrides : "";
+        size_t start = 0;
+        while(start < list.size()){
+            size_t end = list.find(',', start);
+            if(end == std::string::npos){
+                end = list.size();
+            }
+            std::string entry = list.substr(start, end - start);
+            size_t equals = entry.find('=');
+            if(equals != std::string::npos){
+                m_action_ms[entry.substr(0, equals)] = std::strtol(entry.c_str() + equals + 1, NULL, 10);
+            }
+            start = end + 1;
+        }
+    }
+
+    deadline_slot* register_worker(){
+        lock_guard<mutex> guard(m_lock);
+        m_slots.push_back(websocketpp::lib::shared_ptr<deadline_slot>(new deadline_slot()));
+        return m_slots.back().get();
+    }
+
+    long deadline_for(const std::string& action){
+        std::map<std::string, long>::const_iterator it = m_action_ms.find(action);
+        return it == m_action_ms.end() ? m_default_ms : it->second;
+    }
+
+    std::map<std::string, uint64_t> hits(){
+        lock_guard<mutex> guard(m_lock);
+        return m_hits;
+    }
+
+    void run(db_router& db){
+        while(1){
+            std::vector<tracked_connection> to_kill;
+            {
+                lock_guard<mutex> guard(m_lock);
+                int64_t now = steady_now_ms();
+                for(size_t i=0; i<m_slots.size(); i++){
+                    deadline_slot& slot = *m_slots[i];
+                    lock_guard<mutex> slot_guard(slot.lock);
+                    if(slot.deadline_ms == 0 || slot.expired || now < slot.deadline_ms){
+                        continue;
+                    }
+                    slot.expired = true;
+                    m_hits[slot.action]++;
+                    to_kill.insert(to_kill.end(), slot.connections.begin(), slot.connections.end());
+                }
+            }
+            for(size_t i=0; i<to_kill.size(); i++){
+                db.kill_query(to_kill[i].host, to_kill[i].port, to_kill[i].thread_id);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+
+private:
+    long m_default_ms;
+    std::map<std::string, long> m_action_ms;
+    std::vector<websocketpp::lib::shared_ptr<deadline_slot> > m_slots;
+    std::map<std::string, uint64_t> m_hits;
+    mutex m_lock;
+};
+
+struct user_search_entry {
+    std::string user_id;
+    std::string username;
+    std::string firstname;
+    std::string lastname;
+};
+
+class user_search_index {
+    /*
+    In-memory prefix index over username, firstname and lastname so the
+    user_search action can answer typeahead queries without touching MySQL.
+    Every searchable name is stored lowercased in a sorted multimap; a prefix
+    query is a lower_bound followed by a forward scan while the key still
+    starts with the prefix.
+    */
+public:
+    void insert(const user_search_entry& entry){
+        lock_guard<mutex> guard(m_lock);
+        remove_locked(entry.user_id);
+        m_users[entry.user_id] = entry;
+        add_term(entry.username, entry.user_id);
+        add_term(entry.firstname, entry.user_id);
+        add_term(entry.lastname, entry.user_id);
+    }
+
+    void remove(const std::string& user_id){
+        lock_guard<mutex> guard(m_lock);
+        remove_locked(user_id);
+    }
+
+    void clear(){
+        lock_guard<mutex> guard(m_lock);
+        m_users.clear();
+        m_terms.clear();
+    }
+
+    void swap(user_search_index& other){
+        // other must be a private index that no other thread can reach
+        lock_guard<mutex> guard(m_lock);
+        m_users.swap(other.m_users);
+        m_terms.swap(other.m_terms);
+    }
+
+    std::vector<user_search_entry> entries(){
+        lock_guard<mutex> guard(m_lock);
+        std::vector<user_search_entry> users;
+        users.reserve(m_users.size());
+        for(std::map<std::string, user_search_entry>::const_iterator it = m_users.begin(); it != m_users.end(); ++it){
+            users.push_back(it->second);
+        }
+        return users;
+    }
+
+    std::vector<user_search_entry> search(const std::string& query, size_t limit){
+        /*
+        Function to return at most limit users having a username, firstname
+        or lastname that starts with query (case-insensitive)
+        */
+        std::vector<user_search_entry> matches;
+        std::set<std::string> seen;
+        std::string prefix = to_lower(query);
+
+        lock_guard<mutex> guard(m_lock);
+        term_map::const_iterator it = m_terms.lower_bound(prefix);
+        for(; it != m_terms.end() && matches.size() < limit; ++it){
+            if(it->first.compare(0, prefix.size(), prefix) != 0){
+                break;
+            }
+            if(seen.insert(it->second).second){
+                matches.push_back(m_users[it->second]);
+            }
+        }
+        return matches;
+    }
+
+private:
+    typedef std::multimap<std::string, std::string> term_map;
+
+    static std::string to_lower(std::string value){
+        for(size_t i=0; i<value.size(); i++){
+            value[i] = std::tolower(static_cast<unsigned char>(value[i]));
+        }
+        return value;
+    }
+
+    void add_term(const std::string& term, const std::string& user_id){
+        if(!term.empty()){
+            m_terms.insert(std::make_pair(to_lower(term), user_id));
+        }
+    }
+
+    void remove_term(const std::string& term, const std::string& user_id){
+        std::pair<term_map::iterator, term_map::iterator> range = m_terms.equal_range(to_lower(term));
+        for(term_map::iterator it = range.first; it != range.second; ++it){
+            if(it->second == user_id){
+                m_terms.erase(it);
+                return;
+            }
+        }
+    }
+
+    void remove_locked(const std::string& user_id){
+        std::map<std::string, user_search_entry>::iterator it = m_users.find(user_id);
+        if(it == m_users.end()){
+            return;
+        }
+        remove_term(it->second.username, user_id);
+        remove_term(it->second.firstname, user_id);
+        remove_term(it->second.lastname, user_id);
+        m_users.erase(it);
+    }
+
+    std::map<std::string, user_search_entry> m_users;
+    term_map m_terms;
+    mutex m_lock;
+};
+
+class org_chart_index {
+    /*
+    In-memory reporting tree built from user_account.supervisor_id. Each user
+    keeps its supervisor, its direct reports and the size of its subtree, so
+    hierarchy queries cost time proportional to the answer. Updates only walk
+    the management chain above the user that changed.
+    A supervisor_id that refers to a user not (yet) in the index is kept as a
+    dangling link so the subtree re-attaches once that user is inserted.
+    */
+public:
+    void set_supervisor(const std::string& user_id, const std::string& supervisor_id){
+        /*
+        Function to insert a user or move it under a new supervisor. A move
+        that would make a user report to itself or to one of its own reports
+        leaves the user at the top of its own tree.
+        */
+        lock_guard<mutex> guard(m_lock);
+        std::string parent = is_root_supervisor(user_id, supervisor_id) ? "" : supervisor_id;
+
+        if(m_subtree_size.find(user_id) == m_subtree_size.end()){
+            // size of any reports that were already waiting for this user
+            size_t size = 1;
+            std::set<std::string>& children = m_children[user_id];
+            for(std::set<std::string>::iterator it = children.begin(); it != children.end(); ++it){
+                size += m_subtree_size[*it];
+            }
+            m_subtree_size[user_id] = size;
+        }
+        else if(m_parent[user_id] == parent){
+            return;
+        }
+        else{
+            unlink(user_id);
+        }
+
+        if(!parent.empty() && reports_to(parent, user_id)){
+            parent = "";
+        }
+        link(user_id, parent);
+    }
+
+    void remove(const std::string& user_id){
+        /*
+        Function to remove a user; its direct reports keep pointing at the
+        removed id, matching what user_account still holds
+        */
+        lock_guard<mutex> guard(m_lock);
+        if(m_subtree_size.find(user_id) == m_subtree_size.end()){
+            return;
+        }
+        unlink(user_id);
+        m_parent.erase(user_id);
+        m_subtree_size.erase(user_id);
+        if(m_children[user_id].empty()){
+            m_children.erase(user_id);
+        }
+    }
+
+    void clear(){
+        lock_guard<mutex> guard(m_lock);
+        m_parent.clear();
+        m_children.clear();
+        m_subtree_size.clear();
+    }
+
+    void swap(org_chart_index& other){
+        // other must be a private index that no other thread can reach
+        lock_guard<mutex> guard(m_lock);
+        m_parent.swap(other.m_parent);
+        m_children.swap(other.m_children);
+        m_subtree_size.swap(other.m_subtree_size);
+    }
+
+    std::string supervisor_of(const std::string& user_id){
+        lock_guard<mutex> guard(m_lock);
+        std::map<std::string, std::string>::const_iterator it = m_parent.find(user_id);
+        return it == m_parent.end() ? "" : it->second;
+    }
+
+    std::vector<std::string> direct_reports(const std::string& user_id){
+        lock_guard<mutex> guard(m_lock);
+        std::vector<std::string> reports;
+        std::map<std::string, std::set<std::string> >::const_iterator it = m_children.find(user_id);
+        if(m_subtree_size.count(user_id) && it != m_children.end()){
+            reports.assign(it->second.begin(), it->second.end());
+        }
+        return reports;
+    }
+
+    std::vector<std::string> all_reports(const std::string& user_id){
+        /*
+        Function to return every transitive report of user_id in the order
+        they are discovered, not including user_id itself
+        */
+        lock_guard<mutex> guard(m_lock);
+        std::vector<std::string> reports;
+        std::vector<std::string> pending;
+        if(!m_subtree_size.count(user_id)){
+            return reports;
+        }
+        reports.reserve(m_subtree_size[user_id] - 1);
+        pending.push_back(user_id);
+        while(!pending.empty()){
+            std::string current = pending.back();
+            pending.pop_back();
+            std::map<std::string, std::set<std::string> >::const_iterator it = m_children.find(current);
+            if(it == m_children.end()){
+                continue;
+            }
+            for(std::set<std::string>::const_iterator child = it->second.begin(); child != it->second.end(); ++child){
+                reports.push_back(*child);
+                pending.push_back(*child);
+            }
+        }
+        return reports;
+    }
+
+    std::vector<std::string> management_chain(const std::string& user_id){
+        /*
+        Function to return the supervisors of user_id starting with the
+        immediate one and ending at the top of the tree
+        */
+        lock_guard<mutex> guard(m_lock);
+        std::vector<std::string> chain;
+        if(!m_subtree_size.count(user_id)){
+            return chain;
+        }
+        std::string current = m_parent[user_id];
+        while(!current.empty() && m_subtree_size.count(current)){
+            chain.push_back(current);
+            current = m_parent[current];
+        }
+        return chain;
+    }
+
+    size_t subtree_size(const std::string& user_id){
+        /*
+        Function to return the number of users in the subtree rooted at
+        user_id including user_id, or 0 if the user is unknown
+        */
+        lock_guard<mutex> guard(m_lock);
+        std::map<std::string, size_t>::const_iterator it = m_subtree_size.find(user_id);
+        return it == m_subtree_size.end() ? 0 : it->second;
+    }
 
-/* on_open insert connection_hdl into channel
- * on_close remove connection_hdl from channel
- * on_message queue send to all channels
- */
+private:
+    static bool is_root_supervisor(const std::string& user_id, const std::string& supervisor_id){
+        return supervisor_id.empty() || supervisor_id == "0" || supervisor_id == "NULL" || supervisor_id == user_id;
+    }
 
-enum action_type {
-    SUBSCRIBE,
-    UNSUBSCRIBE,
-    MESSAGE
+    bool reports_to(std::string user_id, const std::string& ancestor){
+        // walk up from user_id looking for ancestor
+        while(!user_id.empty()){
+            if(user_id == ancestor){
+                return true;
+            }
+            std::map<std::string, std::string>::const_iterator it = m_parent.find(user_id);
+            if(it == m_parent.end()){
+                return false;
+            }
+            user_id = it->second;
+        }
+        return false;
+    }
+
+    void adjust_ancestors(const std::string& user_id, long delta){
+        std::string current = m_parent[user_id];
+        while(!current.empty()){
+            std::map<std::string, size_t>::iterator it = m_subtree_size.find(current);
+            if(it == m_subtree_size.end()){
+                break;
+            }
+            it->second += delta;
+            current = m_parent[current];
+        }
+    }
+
+    void link(const std::string& user_id, const std::string& parent){
+        m_parent[user_id] = parent;
+        if(!parent.empty()){
+            m_children[parent].insert(user_id);
+            adjust_ancestors(user_id, static_cast<long>(m_subtree_size[user_id]));
+        }
+    }
+
+    void unlink(const std::string& user_id){
+        std::string parent = m_parent[user_id];
+        if(parent.empty()){
+            return;
+        }
+        adjust_ancestors(user_id, -static_cast<long>(m_subtree_size[user_id]));
+        std::map<std::string, std::set<std::string> >::iterator it = m_children.find(parent);
+        if(it != m_children.end()){
+            it->second.erase(user_id);
+            if(it->second.empty() && !m_subtree_size.count(parent)){
+                m_children.erase(it);
+            }
+        }
+        m_parent[user_id] = "";
+    }
+
+    std::map<std::string, std::string> m_parent;
+    std::map<std::string, std::set<std::string> > m_children;
+    std::map<std::string, size_t> m_subtree_size;
+    mutex m_lock;
 };
 
-struct action {
-    action(action_type t, connection_hdl h) : type(t), hdl(h) {}
-    action(action_type t, connection_hdl h, server::message_ptr m)
-      : type(t), hdl(h), msg(m) {}
+struct role_assignment {
+    std::string user_role_id;
+    std::string role_id;
+    std::string user_id;
+    std::string start_date;
+    std::string end_date;
+};
 
-    action_type type;
-    websocketpp::connection_hdl hdl;
-    server::message_ptr msg;
+struct role_period {
+    std::string start_date;
+    std::string end_date;
+};
+
+class role_membership_index {
+    /*
+    In-memory index of effective role membership. An assignment is effective
+    on a date when both the user_role row and its role are active on that
+    date; dates are compared as YYYY-MM-DD strings and an empty start or end
+    date leaves that side of the interval open.
+    Assignments are kept per user sorted by start date, so a point query only
+    scans the assignments that started on or before the date. Each role with
+    assignments also keeps the user ids active today, rebuilt lazily when the
+    role or its assignments change or the date rolls over. They are kept as
+    a bitset while the ids are dense enough for it to stay within a few times
+    the size of a sorted id list, and as that sorted list otherwise.
+    */
+public:
+    void set_assignment(const role_assignment& assignment){
+        lock_guard<mutex> guard(m_lock);
+        remove_assignment_locked(assignment.user_role_id);
+        role_assignment normalized = assignment;
+        normalized.start_date = normalize_date(assignment.start_date);
+        normalized.end_date = normalize_date(assignment.end_date);
+        m_assignments[normalized.user_role_id] = normalized;
+        m_by_user[normalized.user_id].insert(std::make_pair(normalized.start_date, normalized.user_role_id));
+        m_by_role[normalized.role_id].insert(normalized.user_role_id);
+        m_active_users.erase(normalized.role_id);
+    }
+
+    void remove_assignment(const std::string& user_role_id){
+        lock_guard<mutex> guard(m_lock);
+        remove_assignment_locked(user_role_id);
+    }
+
+    void set_role(const std::string& role_id, const std::string& start_date, const std::string& end_date){
+        lock_guard<mutex> guard(m_lock);
+        role_period period;
+        period.start_date = normalize_date(start_date);
+        period.end_date = normalize_date(end_date);
+        m_roles[role_id] = period;
+        m_active_users.erase(role_id);
+    }
+
+    void remove_role(const std::string& role_id){
+        lock_guard<mutex> guard(m_lock);
+        m_roles.erase(role_id);
+        m_active_users.erase(role_id);
+    }
+
+    void clear(){
+        lock_guard<mutex> guard(m_lock);
+        m_assignments.clear();
+        m_by_user.clear();
+        m_by_role.clear();
+        m_roles.clear();
+        m_active_users.clear();
+    }
+
+    void swap(role_membership_index& other){
+        // other must be a private index that no other thread can reach
+        lock_guard<mutex> guard(m_lock);
+        m_assignments.swap(other.m_assignments);
+        m_by_user.swap(other.m_by_user);
+        m_by_role.swap(other.m_by_role);
+        m_roles.swap(other.m_roles);
+        m_active_users.clear();
+    }
+
+    std::vector<role_assignment> assignments(){
+        lock_guard<mutex> guard(m_lock);
+        std::vector<role_assignment> rows;
+        rows.reserve(m_assignments.size());
+        for(std::map<std::string, role_assignment>::const_iterator it = m_assignments.begin(); it != m_assignments.end(); ++it){
+            rows.push_back(it->second);
+        }
+        return rows;
+    }
+
+    std::map<std::string, role_period> roles(){
+        lock_guard<mutex> guard(m_lock);
+        return m_roles;
+    }
+
+    std::vector<std::string> roles_for_user(const std::string& user_id, const std::string& date){
+        /*
+        Function to return the distinct role ids user_id holds on date
+        */
+        lock_guard<mutex> guard(m_lock);
+        std::string day = date.empty() ? current_date() : normalize_date(date);
+        std::set<std::string> roles;
+        std::map<std::string, start_map>::const_iterator user = m_by_user.find(user_id);
+        if(user == m_by_user.end()){
+            return std::vector<std::string>();
+        }
+        start_map::const_iterator end = day.empty() ? user->second.end() : user->second.upper_bound(day);
+        for(start_map::const_iterator it = user->second.begin(); it != end; ++it){
+            const role_assignment& assignment = m_assignments[it->second];
+            if(is_effective(assignment, day)){
+                roles.insert(assignment.role_id);
+            }
+        }
+        return std::vector<std::string>(roles.begin(), roles.end());
+    }
+
+    std::vector<std::string> users_for_role(const std::string& role_id, const std::string& date){
+        /*
+        Function to return the user ids holding role_id on date; queries for
+        today are served from the cached bitset of the role
+        */
+        lock_guard<mutex> guard(m_lock);
+        std::string day = normalize_date(date);
+        std::string today = current_date();
+        std::vector<std::string> users;
+
+        if(day.empty() || day == today){
+            // only roles that have assignments get a cache entry
+            if(m_by_role.find(role_id) == m_by_role.end()){
+                return users;
+            }
+            active_users& active = m_active_users[role_id];
+            if(active.date != today){
+                build_active_users(role_id, today, active);
+            }
+            for(size_t word=0; word<active.bits.size(); word++){
+                for(uint64_t bits = active.bits[word]; bits; bits &= bits - 1){
+                    users.push_back(std::to_string(word * 64 + __builtin_ctzll(bits)));
+                }
+            }
+            for(size_t i=0; i<active.ids.size(); i++){
+                users.push_back(std::to_string(active.ids[i]));
+            }
+            return users;
+        }
+
+        std::set<std::string> matches;
+        std::map<std::string, std::set<std::string> >::const_iterator role = m_by_role.find(role_id);
+        if(role != m_by_role.end()){
+            for(std::set<std::string>::const_iterator it = role->second.begin(); it != role->second.end(); ++it){
+                const role_assignment& assignment = m_assignments[*it];
+                if(is_effective(assignment, day)){
+                    matches.insert(assignment.user_id);
+                }
+            }
+        }
+        return std::vector<std::string>(matches.begin(), matches.end());
+    }
+
+    static std::string current_date(){
+        char buffer[11];
+        time_t now = time(NULL);
+        struct tm local;
+        localtime_r(&now, &local);
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d", &local);
+        return std::string(buffer);
+    }
+
+private:
+    typedef std::multimap<std::string, std::string> start_map;
+
+    struct active_users {
+        std::string date;
+        std::vector<uint64_t> bits;
+        std::vector<uint64_t> ids;
+    };
+
+    static std::string normalize_date(const std::string& date){
+        // DATETIME values are compared on their date part only
+        if(date == "NULL" || date.compare(0, 4, "0000") == 0){
+            return "";
+        }
+        return date.substr(0, 10);
+    }
+
+    static bool in_period(const std::string& start_date, const std::string& end_date, const std::string& day){
+        return (start_date.empty() || start_date <= day) && (end_date.empty() || day <= end_date);
+    }
+
+    bool is_effective(const role_assignment& assignment, const std::string& day){
+        std::map<std::string, role_period>::const_iterator role = m_roles.find(assignment.role_id);
+        if(role == m_roles.end()){
+            return false;
+        }
+        return in_period(assignment.start_date, assignment.end_date, day) &&
+            in_period(role->second.start_date, role->second.end_date, day);
+    }
+
+    void build_active_users(const std::string& role_id, const std::string& today, active_users& active){
+        active.date = today;
+        active.bits.clear();
+        active.ids.clear();
+        std::map<std::string, std::set<std::string> >::const_iterator role = m_by_role.find(role_id);
+        if(role == m_by_role.end()){
+            return;
+        }
+        for(std::set<std::string>::const_iterator it = role->second.begin(); it != role->second.end(); ++it){
+            const role_assignment& assignment = m_assignments[*it];
+            if(!is_effective(assignment, today)){
+                continue;
+            }
+            char *end;
+            unsigned long long user_id = std::strtoull(assignment.user_id.c_str(), &end, 10);
+            if(assignment.user_id.empty() || *end != '\0'){
+                continue;
+            }
+            active.ids.push_back(user_id);
+        }
+        std::sort(active.ids.begin(), active.ids.end());
+        active.ids.erase(std::unique(active.ids.begin(), active.ids.end()), active.ids.end());
+
+        // a bitset of 4 words per id (plus 8KB) at most, a few large ids
+        // would otherwise allocate up to half a gigabyte
+        if(active.ids.empty() || active.ids.back() / 64 + 1 > active.ids.size() * 4 + 1024){
+            return;
+        }
+        active.bits.resize(active.ids.back() / 64 + 1, 0);
+        for(size_t i=0; i<active.ids.size(); i++){
+            active.bits[active.ids[i] / 64] |= uint64_t(1) << (active.ids[i] % 64);
+        }
+        std::vector<uint64_t>().swap(active.ids);
+    }
+
+    void remove_assignment_locked(const std::string& user_role_id){
+        std::map<std::string, role_assignment>::iterator it = m_assignments.find(user_role_id);
+        if(it == m_assignments.end()){
+            return;
+        }
+        const role_assignment& assignment = it->second;
+
+        start_map& starts = m_by_user[assignment.user_id];
+        std::pair<start_map::iterator, start_map::iterator> range = starts.equal_range(assignment.start_date);
+        for(start_map::iterator start = range.first; start != range.second; ++start){
+            if(start->second == user_role_id){
+                starts.erase(start);
+                break;
+            }
+        }
+        if(starts.empty()){
+            m_by_user.erase(assignment.user_id);
+        }
+
+        m_by_role[assignment.role_id].erase(user_role_id);
+        if(m_by_role[assignment.role_id].empty()){
+            m_by_role.erase(assignment.role_id);
+        }
+        m_active_users.erase(assignment.role_id);
+        m_assignments.erase(it);
+    }
+
+    std::map<std::string, role_assignment> m_assignments;
+    std::map<std::string, start_map> m_by_user;
+    std::map<std::string, std::set<std::string> > m_by_role;
+    std::map<std::string, role_period> m_roles;
+    std::map<std::string, active_users> m_active_users;
+    mutex m_lock;
+};
+
+
+class row_locks {
+    /*
+    Striped locks keyed by table and row id. A write that updates or
+    deletes a row holds the lock of the row from its statement until its
+    index update is done, so updates of one row reach the indexes in the
+    order the database committed them while writes to other rows run
+    concurrently.
+    */
+public:
+    mutex& for_row(const std::string& table, const std::string& id){
+        size_t hash = std::hash<std::string>()(table + ":" + id);
+        return m_stripes[hash % stripe_count];
+    }
+
+private:
+    static const size_t stripe_count = 64;
+    mutex m_stripes[stripe_count];
+};
+
+class response_cache {
+    /*
+    Serialized responses of the list and drop-down actions keyed by action
+    name. Payloads are shared and immutable so a cached reply can be handed
+    to several senders without copying.
+    Local writes invalidate entries right away; entries also expire after
+    ttl_ms so writes made by other server instances or directly in SQL show
+    up within that time (0 keeps entries until invalidated).
+    */
+public:
+    typedef websocketpp::lib::shared_ptr<const std::string> payload_ptr;
+
+    response_cache() : m_ttl_ms(0) {}
+
+    void set_ttl_ms(long ttl_ms){
+        m_ttl_ms = ttl_ms < 0 ? 0 : ttl_ms;
+    }
+
+    payload_ptr get(const std::string& key){
+        lock_guard<mutex> guard(m_lock);
+        std::map<std::string, entry>::const_iterator it = m_payloads.find(key);
+        if(it == m_payloads.end() || (m_ttl_ms > 0 && steady_now_ms() - it->second.stored_ms >= m_ttl_ms)){
+            return payload_ptr();
+        }
+        return it->second.payload;
+    }
+
+    void put(const std::string& key, const std::string& payload){
+        put(key, payload_ptr(new std::string(payload)));
+    }
+
+    void put(const std::string& key, payload_ptr payload){
+        lock_guard<mutex> guard(m_lock);
+        entry& cached = m_payloads[key];
+        cached.payload = payload;
+        cached.stored_ms = steady_now_ms();
+    }
+
+    void invalidate(const std::string& key){
+        lock_guard<mutex> guard(m_lock);
+        m_payloads.erase(key);
+    }
+
+    std::map<std::string, payload_ptr> entries(){
+        lock_guard<mutex> guard(m_lock);
+        std::map<std::string, payload_ptr> payloads;
+        for(std::map<std::string, entry>::const_iterator it = m_payloads.begin(); it != m_payloads.end(); ++it){
+            payloads[it->first] = it->second.payload;
+        }
+        return payloads;
+    }
+
+private:
+    struct entry {
+        payload_ptr payload;
+        int64_t stored_ms;
+    };
+
+    long m_ttl_ms;
+    std::map<std::string, entry> m_payloads;
+    mutex m_lock;
+};
+
+class single_flight {
+    /*
+    Collapses concurrent calls with the same key into one: the first caller
+    runs the function, later callers wait for it and share its result.
+    */
+public:
+    typedef response_cache::payload_ptr payload_ptr;
+
+    single_flight() : m_executed(0), m_coalesced(0) {}
+
+    payload_ptr run(const std::string& key, websocketpp::lib::function<payload_ptr()> fn){
+        websocketpp::lib::shared_ptr<flight> current;
+        bool leader = false;
+        {
+            lock_guard<mutex> guard(m_lock);
+            std::map<std::string, websocketpp::lib::shared_ptr<flight> >::iterator it = m_flights.find(key);
+            if(it == m_flights.end()){
+                current.reset(new flight());
+                m_flights[key] = current;
+                leader = true;
+            }
+            else{
+                current = it->second;
+            }
+        }
+
+        if(!leader){
+            m_coalesced.fetch_add(1, std::memory_order_relaxed);
+            unique_lock<mutex> lock(m_lock);
+            while(!current->done){
+                m_done_cond.wait(lock);
+            }
+            return current->result;
+        }
+
+        m_executed.fetch_add(1, std::memory_order_relaxed);
+        payload_ptr result;
+        try {
+            result = fn();
+        } catch (...) {
+            finish(key, current, payload_ptr());
+            throw;
+        }
+        finish(key, current, result);
+        return result;
+    }
+
+    uint64_t executed() const {
+        return m_executed.load(std::memory_order_relaxed);
+    }
+
+    uint64_t coalesced() const {
+        return m_coalesced.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct flight {
+        flight() : done(false) {}
+
+        bool done;
+        payload_ptr result;
+    };
+
+    void finish(const std::string& key, websocketpp::lib::shared_ptr<flight> current, payload_ptr result){
+        {
+            lock_guard<mutex> guard(m_lock);
+            current->result = result;
+            current->done = true;
+            m_flights.erase(key);
+        }
+        m_done_cond.notify_all();
+    }
+
+    std::map<std::string, websocketpp::lib::shared_ptr<flight> > m_flights;
+    mutex m_lock;
+    condition_variable m_done_cond;
+    std::atomic<uint64_t> m_executed;
+    std::atomic<uint64_t> m_coalesced;
+};
+
+struct snapshot_data {
+    /*
+    Contents of a warm-start snapshot; every table is a list of records and
+    every record a list of string fields
+    */
+    typedef std::vector<std::string> record;
+
+    uint64_t change_version;
+    std::vector<record> payloads;    // action, payload
+    std::vector<record> users;       // user_id, username, firstname, lastname, supervisor_id
+    std::vector<record> roles;       // role_id, role_start_date, role_end_date
+    std::vector<record> user_roles;  // user_role_id, role_id, user_id, user_role_start_date, user_role_end_date
+};
+
+class cache_snapshot {
+    /*
+    Reads and writes snapshot_data as a compact binary file through mmap.
+    Layout, all integers little endian as written by the host:
+        magic "UMSNAP" | uint16 format version | uint64 change version |
+        4 x (uint32 record count | uint32 field count | fields) |
+        uint64 FNV-1a checksum of everything before it
+    Each field is a uint32 length followed by its bytes. The file is written
+    to a temporary path and renamed, so readers never see a partial file.
+    */
+public:
+    static bool write(const std::string& path, const snapshot_data& data){
+        std::string buffer(magic, sizeof(magic));
+        append_integer(buffer, format_version, 2);
+        append_integer(buffer, data.change_version, 8);
+        append_table(buffer, data.payloads, 2);
+        append_table(buffer, data.users, 5);
+        append_table(buffer, data.roles, 3);
+        append_table(buffer, data.user_roles, 5);
+        append_integer(buffer, checksum(buffer.data(), buffer.size()), 8);
+
+        std::string temporary_path = path + ".tmp";
+        int fd = open(temporary_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(fd < 0){
+            return false;
+        }
+        bool written = false;
+        if(ftruncate(fd, buffer.size()) == 0){
+            void* mapped = mmap(NULL, buffer.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(mapped != MAP_FAILED){
+                memcpy(mapped, buffer.data(), buffer.size());
+                written = msync(mapped, buffer.size(), MS_SYNC) == 0;
+                munmap(mapped, buffer.size());
+            }
+        }
+        close(fd);
+        if(!written || rename(temporary_path.c_str(), path.c_str()) != 0){
+            unlink(temporary_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static bool read(const std::string& path, snapshot_data& data){
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            return false;
+        }
+        struct stat file_stat;
+        if(fstat(fd, &file_stat) != 0 || file_stat.st_size < header_size + 8){
+            close(fd);
+            return false;
+        }
+        size_t size = file_stat.st_size;
+        void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapped == MAP_FAILED){
+            return false;
+        }
+
+        const char* bytes = static_cast<const char*>(mapped);
+        size_t offset = sizeof(magic);
+        bool valid = memcmp(bytes, magic, sizeof(magic)) == 0 &&
+            read_integer(bytes, size, offset, 2) == format_version &&
+            checksum(bytes, size - 8) == read_trailer(bytes, size);
+        if(valid){
+            data.change_version = read_integer(bytes, size, offset, 8);
+            valid = read_table(bytes, size - 8, offset, data.payloads, 2) &&
+                read_table(bytes, size - 8, offset, data.users, 5) &&
+                read_table(bytes, size - 8, offset, data.roles, 3) &&
+                read_table(bytes, size - 8, offset, data.user_roles, 5) &&
+                offset == size - 8;
+        }
+        munmap(mapped, size);
+        return valid;
+    }
+
+private:
+    static const char magic[6];
+    static const uint64_t format_version = 1;
+    static const long header_size = 6 + 2 + 8;
+
+    static uint64_t checksum(const char* bytes, size_t size){
+        uint64_t hash = 14695981039346656037ULL;
+        for(size_t i=0; i<size; i++){
+            hash ^= static_cast<unsigned char>(bytes[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    static void append_integer(std::string& buffer, uint64_t value, size_t width){
+        buffer.append(reinterpret_cast<const char*>(&value), width);
+    }
+
+    static void append_table(std::string& buffer, const std::vector<snapshot_data::record>& table, uint32_t field_count){
+        append_integer(buffer, table.size(), 4);
+        append_integer(buffer, field_count, 4);
+        for(size_t i=0; i<table.size(); i++){
+            for(uint32_t field=0; field<field_count; field++){
+                const std::string& value = field < table[i].size() ? table[i][field] : std::string();
+                append_integer(buffer, value.size(), 4);
+                buffer.append(value);
+            }
+        }
+    }
+
+    static uint64_t read_integer(const char* bytes, size_t size, size_t& offset, size_t width){
+        // returns 0 and moves offset past size when the field is truncated
+        uint64_t value = 0;
+        if(offset + width > size){
+            offset = size + 1;
+            return 0;
+        }
+        memcpy(&value, bytes + offset, width);
+        offset += width;
+        return value;
+    }
+
+    static uint64_t read_trailer(const char* bytes, size_t size){
+        uint64_t value;
+        memcpy(&value, bytes + size - 8, 8);
+        return value;
+    }
+
+    static bool read_table(const char* bytes, size_t size, size_t& offset, std::vector<snapshot_data::record>& table, uint32_t expected_fields){
+        uint64_t record_count = read_integer(bytes, size, offset, 4);
+        uint64_t field_count = read_integer(bytes, size, offset, 4);
+        if(offset > size || field_count != expected_fields){
+            return false;
+        }
+        table.clear();
+        for(uint64_t i=0; i<record_count; i++){
+            snapshot_data::record record;
+            for(uint64_t field=0; field<field_count; field++){
+                uint64_t length = read_integer(bytes, size, offset, 4);
+                if(offset > size || offset + length > size){
+                    return false;
+                }
+                record.push_back(std::string(bytes + offset, length));
+                offset += length;
+            }
+            table.push_back(record);
+        }
+        return true;
+    }
 };
 
+const char cache_snapshot::magic[6] = {'U', 'M', 'S', 'N', 'A', 'P'};
+
+struct export_stream {
+    /*
+    Body of an HTTP export on its way from the reader thread to the asio
+    loop. The reader queues pieces in pending and waits on space while
+    max_buffered_bytes are not yet written; the asio loop writes them one
+    at a time.
+    */
+    static const size_t max_buffered_bytes = 256 * 1024;
+
+    explicit export_stream(server::connection_ptr c)
+      : con(c), buffered_bytes(0), writing(false), done(false), failed(false) {}
+
+    server::connection_ptr con;
+    mutex lock;
+    condition_variable space;
+    std::queue<std::string> pending;
+    std::string in_flight;          // piece the asio loop is writing
+    size_t buffered_bytes;          // pending plus in_flight
+    bool writing;                   // a write is posted or in flight
+    bool done;                      // the reader queued its last piece
+    bool failed;                    // a write failed, the reader stops
+};
 
 class broadcast_server {
 public:
     broadcast_server() {
+        // Heartbeat and idle eviction settings
+        m_heartbeat_interval_ms = env_or_default("WS_HEARTBEAT_INTERVAL_MS", 30000);
+        m_idle_timeout_s = env_or_default("WS_IDLE_TIMEOUT_S", 1800);
+
+        // Outbound queue limits for slow consumers
+        m_send_soft_limit = env_or_default("WS_SEND_SOFT_LIMIT_BYTES", 1 << 20);
+        m_send_hard_limit = env_or_default("WS_SEND_HARD_LIMIT_BYTES", 16 << 20);
+        m_dropped_notifications.store(0);
+        m_slow_consumer_disconnects.store(0);
+
+        // Tell logged in clients which tables changed, batched every
+        // WS_CHANGE_NOTIFY_MS milliseconds (0, the default, disables)
+        m_change_notify_ms = env_or_default("WS_CHANGE_NOTIFY_MS", 0);
+
+        // Concurrent HTTP table exports
+        m_max_exports = env_or_default("WS_EXPORT_MAX_CONCURRENT", 4);
+        m_active_exports.store(0);
+        m_handshake_timeout_ms = env_or_default("WS_HANDSHAKE_TIMEOUT_MS", 5000);
+
+        // Read/write splitting settings, endpoints are read by db_router
+        m_pin_after_write_ms = env_or_default("WS_DB_PIN_AFTER_WRITE_MS", 2000);
+        m_cache_pin_after_write_ms = std::max(m_pin_after_write_ms, m_db.stale_read_window_ms());
+        m_last_write_ms.store(0);
+
+        // Request tracing settings
+        m_tracer.set_sample_rate(env_or_default("WS_TRACE_SAMPLE_RATE", 0));
+        const char* trace_path = std::getenv("WS_TRACE_PATH");
+        m_trace_path = trace_path ? trace_path : "server_trace";
+
+        // Warm-start snapshot settings
+        const char* snapshot_path = std::getenv("WS_SNAPSHOT_PATH");
+        m_snapshot_path = snapshot_path ? snapshot_path : "server_cache.snapshot";
+        m_snapshot_interval_s = env_or_default("WS_SNAPSHOT_INTERVAL_S", 60);
+        m_response_cache.set_ttl_ms(env_or_default("WS_CACHE_TTL_MS", 5000));
+        m_index_refresh_s = env_or_default("WS_INDEX_REFRESH_S", 300);
+        m_change_version = 0;
+        m_snapshot_version = 0;
+        m_snapshot_written = false;
+
+        // Threads running the asio loop, connections and TLS handshakes
+        // are spread across them
+        m_io_threads = env_or_default("WS_IO_THREADS", std::max(1u, std::thread::hardware_concurrency()));
+
+        m_worker_count = std::max(env_or_default("WS_WORKER_THREADS", 4), 1L);
+
+        // websocketpp logs synchronously to std::cout from the io threads.
+        // Connections and frames are not logged at all, and only errors
+        // that affect the whole server are kept.
+        m_server.clear_access_channels(websocketpp::log::alevel::all);
+        m_server.clear_error_channels(websocketpp::log::elevel::all);
+        m_server.set_error_channels(websocketpp::log::elevel::rerror | websocketpp::log::elevel::fatal);
+
         // Initialize Asio Transport
         m_server.init_asio();
+#ifdef WS_TLS
+        m_server.set_tls_init_handler(bind(&broadcast_server::on_tls_init,this,::_1));
+#endif
 
         // Register handler callbacks
         m_server.set_open_handler(bind(&broadcast_server::on_open,this,::_1));
         m_server.set_close_handler(bind(&broadcast_server::on_close,this,::_1));
         m_server.set_message_handler(bind(&broadcast_server::on_message,this,::_1,::_2));
+        m_server.set_http_handler(bind(&broadcast_server::on_http,this,::_1));
+        m_server.set_pong_handler(bind(&broadcast_server::on_pong,this,::_1,::_2));
+        m_server.set_pong_timeout_handler(bind(&broadcast_server::on_pong_timeout,this,::_1,::_2));
+        m_server.set_pong_timeout(m_heartbeat_interval_ms);
+
+        // the open handshake deadline is enforced per connection by
+        // on_handshake_timeout, which leaves streaming exports alone
+        m_server.set_open_handshake_timeout(0);
+        m_server.set_tcp_post_init_handler(bind(&broadcast_server::on_tcp_post_init,this,::_1));
     }
 
     void run(uint16_t port) {
+#ifdef WS_TLS
+        // One context for every connection so the session cache and ticket
+        // keys are shared and returning clients can resume
+        try {
+            m_tls_context = create_tls_context();
+        } catch (const std::exception & e) {
+            LOG_ERROR("TLS setup failed: " << e.what());
+            return;
+        }
+#endif
+
         // listen on specified port
         m_server.listen(port);
 
-        // Start the server accept loop
-        m_server.start_accept();
+        // Start the server accept loop
+        m_server.start_accept();
+
+        // Start pinging silent connections and evicting idle ones
+        schedule_heartbeat();
+
+        // Start the ASIO io_service run loop on the calling thread and
+        // WS_IO_THREADS - 1 more
+        std::vector<thread> io_threads;
+        for (long i = 1; i < m_io_threads; i++) {
+            io_threads.push_back(thread(bind(&broadcast_server::run_io_loop,this)));
+        }
+        run_io_loop();
+        for (size_t i = 0; i < io_threads.size(); i++) {
+            io_threads[i].join();
+        }
+    }
+
+    void run_io_loop() {
+        try {
+            m_server.run();
+        } catch (const std::exception & e) {
+            LOG_ERROR(e.what());
+        }
+    }
+
+#ifdef WS_TLS
+    context_ptr create_tls_context() {
+        /*
+        Function to build the TLS context shared by all connections.
+        Certificate and key are PEM files from WS_TLS_CERT and WS_TLS_KEY
+        (default server.pem for both). Only TLS 1.2 and newer with ECDHE
+        key exchange and AEAD ciphers are offered, AES-GCM first since it
+        is hardware accelerated on the servers we run on. Sessions can be
+        resumed by ticket or from the server side cache, which skips the
+        certificate signature and key exchange on reconnects.
+        */
+        namespace ssl = websocketpp::lib::asio::ssl;
+        const char* cert = std::getenv("WS_TLS_CERT");
+        const char* key = std::getenv("WS_TLS_KEY");
+
+        context_ptr ctx(new ssl::context(ssl::context::sslv23_server));
+        ctx->set_options(ssl::context::default_workarounds |
+                         ssl::context::no_sslv2 |
+                         ssl::context::no_sslv3 |
+                         ssl::context::no_tlsv1 |
+                         ssl::context::no_tlsv1_1 |
+                         ssl::context::no_compression |
+                         ssl::context::single_dh_use);
+        ctx->use_certificate_chain_file(cert ? cert : "server.pem");
+        ctx->use_private_key_file(key ? key : "server.pem", ssl::context::pem);
+
+        SSL_CTX* native = ctx->native_handle();
+        SSL_CTX_set_options(native, SSL_OP_CIPHER_SERVER_PREFERENCE);
+        if (SSL_CTX_set_cipher_list(native,
+                "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+                "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305") != 1) {
+            throw std::runtime_error("no usable ECDHE cipher");
+        }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        SSL_CTX_set_ciphersuites(native, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+#endif
+        // X25519 first, it is the cheapest key exchange
+        SSL_CTX_set1_curves_list(native, "X25519:P-256");
+
+        static const unsigned char session_context[] = "user_management";
+        SSL_CTX_set_session_id_context(native, session_context, sizeof(session_context) - 1);
+        SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(native, env_or_default("WS_TLS_SESSION_CACHE_SIZE", 20480));
+        SSL_CTX_set_timeout(native, env_or_default("WS_TLS_SESSION_TIMEOUT_S", 7200));
+        SSL_CTX_clear_options(native, SSL_OP_NO_TICKET);
+        return ctx;
+    }
+
+    context_ptr on_tls_init(connection_hdl hdl) {
+        return m_tls_context;
+    }
+#endif
+
+    void on_open(connection_hdl hdl) {
+        m_connections.add(hdl);
+    }
+
+    void on_close(connection_hdl hdl) {
+        m_connections.remove(hdl);
+    }
+
+    void on_pong(connection_hdl hdl, std::string) {
+        m_connections.touch(hdl);
+    }
+
+    void on_pong_timeout(connection_hdl hdl, std::string) {
+        // peer did not answer the heartbeat, treat it as gone
+        websocketpp::lib::error_code ec;
+        m_server.close(hdl, websocketpp::close::status::going_away, "heartbeat timeout", ec);
+    }
+
+    void schedule_heartbeat() {
+        m_server.set_timer(m_heartbeat_interval_ms, bind(&broadcast_server::on_heartbeat,this,::_1));
+    }
+
+    void on_heartbeat(websocketpp::lib::error_code const & ec) {
+        /*
+        Timer callback that pings connections which have been silent for a
+        heartbeat interval and closes connections idle for longer than the
+        idle timeout
+        */
+        if (ec) {
+            return;
+        }
+        connection_registry::hdl_list to_ping;
+        connection_registry::hdl_list to_evict;
+        m_connections.sweep(m_heartbeat_interval_ms, static_cast<int64_t>(m_idle_timeout_s) * 1000, to_ping, to_evict);
+
+        websocketpp::lib::error_code send_ec;
+        for (size_t i = 0; i < to_ping.size(); i++) {
+            m_server.ping(to_ping[i], "", send_ec);
+        }
+        for (size_t i = 0; i < to_evict.size(); i++) {
+            m_server.close(to_evict[i], websocketpp::close::status::going_away, "idle timeout", send_ec);
+        }
+        schedule_heartbeat();
+    }
+
+    void on_message(connection_hdl hdl, server::message_ptr msg) {
+        if (!m_connections.begin_request(hdl)) {
+            return;
+        }
+        uint64_t trace_id = m_tracer.start_request();
+        m_tracer.record(trace_id, TRACE_RECEIVED);
 
-        // Start the ASIO io_service run loop
-        try {
-            m_server.run();
-        } catch (const std::exception & e) {
-            std::cout << e.what() << std::endl;
+        // queue message up for the workers, unless an earlier request of
+        // the connection is still running; it is dispatched after that one
+        action a(MESSAGE,hdl,msg,trace_id);
+        if (m_connections.queue_request(hdl, a)) {
+            dispatch(a);
         }
     }
 
-    void on_open(connection_hdl hdl) {
+    void dispatch(const action& a) {
         {
             lock_guard<mutex> guard(m_action_lock);
-            m_actions.push(action(SUBSCRIBE,hdl));
+            m_actions.push(a);
         }
         m_action_cond.notify_one();
     }
 
-    void on_close(connection_hdl hdl) {
-        {
-            lock_guard<mutex> guard(m_action_lock);
-            m_actions.push(action(UNSUBSCRIBE,hdl));
+    void warm_start() {
+        // Fill the caches and indexes before the workers start
+        if(load_snapshot()){
+            // serve from the snapshot while the database catches up
+            thread reconcile(bind(&broadcast_server::reconcile_with_database,this));
+            reconcile.detach();
+        }
+        else{
+            // the indexes answer queries on their own, so wait for the
+            // database instead of serving empty results
+            retry_with_backoff(bind(&broadcast_server::load_user_indexes,this), "user indexes");
+            retry_with_backoff(bind(&broadcast_server::load_role_membership_index,this), "role membership index");
         }
-        m_action_cond.notify_one();
     }
 
-    void on_message(connection_hdl hdl, server::message_ptr msg) {
-        // queue message up for sending by processing thread
-        {
-            lock_guard<mutex> guard(m_action_lock);
-            m_actions.push(action(MESSAGE,hdl,msg));
-        }
-        m_action_cond.notify_one();
+    size_t worker_count() const {
+        return m_worker_count;
     }
 
     void process_messages() {
-        
+        current_deadline_slot() = m_deadlines.register_worker();
+
         while(1) {
             unique_lock<mutex> lock(m_action_lock);
             while(m_actions.empty()) {
@@ -116,30 +2424,28 @@ public:
 
             lock.unlock();
 
-            if (a.type == SUBSCRIBE) {
-                lock_guard<mutex> guard(m_connection_lock);
-                m_connections.insert(a.hdl);
-            } else if (a.type == UNSUBSCRIBE) {
-                lock_guard<mutex> guard(m_connection_lock);
-                m_connections.erase(a.hdl);
-            } else if (a.type == MESSAGE) {
-                lock_guard<mutex> guard(m_connection_lock);
-
-                con_list::iterator it;
-                for (it = m_connections.begin(); it != m_connections.end(); ++it) {
-                    
-                    // Parse json from the response and the get the action
-                    std::string response_json = a.msg->get_payload();
-                    char char_response_json[response_json.length()]; 
-
-                    for (int i = 0; i < sizeof(char_response_json); i++) { 
-                        char_response_json[i] = response_json[i]; 
-                    } 
-                    Document parsed_response_json = parse_json(response_json.c_str());
-                    std::string payload_response = compare_and_perform_action(parsed_response_json);
-                    
-                    a.msg->set_payload(payload_response);
-                    m_server.send(*it,a.msg);
+            if (a.type == MESSAGE) {
+                m_tracer.record(a.trace_id, TRACE_DEQUEUED);
+                current_trace_id() = a.trace_id;
+
+                // Parse json from the response and the get the action
+                std::string response_json = a.msg->get_payload();
+                Document parsed_response_json = parse_json(response_json.c_str());
+                if (a.trace_id && parsed_response_json.IsObject() && parsed_response_json.HasMember("action") && parsed_response_json["action"].IsString()) {
+                    m_tracer.record(a.trace_id, TRACE_PARSED, parsed_response_json["action"].GetString());
+                }
+                response_cache::payload_ptr payload_response = perform_action_with_deadline(parsed_response_json, a.hdl);
+                m_tracer.record(a.trace_id, TRACE_HANDLED);
+
+                send_message(a.hdl, payload_response, a.msg->get_opcode(), OUTBOUND_REPLY, a.trace_id);
+                current_trace_id() = 0;
+                m_connections.end_request(a.hdl);
+
+                // the next request of the connection goes to the back of
+                // the queue, so a busy connection cannot hold a worker
+                action next(MESSAGE, a.hdl);
+                if (m_connections.next_request(a.hdl, next)) {
+                    dispatch(next);
                 }
             } else {
                 // undefined.
@@ -147,6 +2453,410 @@ public:
         }
     }
 
+    void on_tcp_post_init(connection_hdl hdl) {
+        // a connection timer runs on the strand of the connection, like the
+        // handshake timer of websocketpp it replaces
+        if (m_handshake_timeout_ms > 0) {
+            server::connection_ptr con = m_server.get_con_from_hdl(hdl);
+            con->set_timer(m_handshake_timeout_ms, bind(&broadcast_server::on_handshake_timeout,this,hdl,::_1));
+        }
+    }
+
+    void on_handshake_timeout(connection_hdl hdl, websocketpp::lib::error_code const & ec) {
+        /*
+        Replaces websocketpp's open handshake timer, which is only cancelled
+        once an HTTP response is written and so would cut off every export
+        that streams for longer than the timeout. websocketpp has no way to
+        cancel it for a single connection. Connections that are still in
+        their handshake and not exporting are terminated the way
+        websocketpp's own timer does it.
+        */
+        if (ec) {
+            return;
+        }
+        websocketpp::lib::error_code con_ec;
+        server::connection_ptr con = m_server.get_con_from_hdl(hdl, con_ec);
+        if (con_ec) {
+            return;
+        }
+        // finish_export terminates under the same lock, so the state read
+        // here is either before the export started or after it ended
+        lock_guard<mutex> guard(m_exports_lock);
+        if (m_exporting.count(hdl) || con->get_state() != websocketpp::session::state::connecting) {
+            return;
+        }
+        con->terminate(websocketpp::error::make_error_code(websocketpp::error::open_handshake_timeout));
+    }
+
+    static bool query_parameter(const std::string& resource, const std::string& name, std::string& value) {
+        // value of name in the query string of resource, false when absent
+        size_t start = resource.find('?');
+        while (start != std::string::npos) {
+            start++;
+            size_t end = resource.find('&', start);
+            std::string pair = resource.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            size_t equals = pair.find('=');
+            if (pair.substr(0, equals) == name) {
+                value = equals == std::string::npos ? "" : pair.substr(equals + 1);
+                return true;
+            }
+            start = end;
+        }
+        return false;
+    }
+
+    void on_http(connection_hdl hdl) {
+        /*
+        Plain HTTP requests on the WebSocket port. Only table exports are
+        served:
+            GET /export/<table>[?format=ndjson|csv]
+        for user_account, roles, user_role and work_skill. The rows are read
+        on a separate thread and written with chunked transfer encoding from
+        the asio loop, see export_stream.
+        */
+        server::connection_ptr con = m_server.get_con_from_hdl(hdl);
+        std::string resource = con->get_resource();
+        std::string path = resource.substr(0, resource.find('?'));
+        std::string format = "ndjson";
+        if (query_parameter(resource, "format", format) && format != "ndjson" && format != "csv") {
+            con->set_status(websocketpp::http::status_code::bad_request);
+            con->set_body("format must be ndjson or csv\n");
+            return;
+        }
+
+        std::string query = export_query(path.compare(0, 8, "/export/") == 0 ? path.substr(8) : "");
+        if (query.empty()) {
+            con->set_status(websocketpp::http::status_code::not_found);
+            con->set_body("not found\n");
+            return;
+        }
+        if (m_active_exports.fetch_add(1) >= m_max_exports) {
+            m_active_exports.fetch_sub(1);
+            con->set_status(websocketpp::http::status_code::service_unavailable);
+            con->set_body("too many exports in progress\n");
+            return;
+        }
+
+        {
+            lock_guard<mutex> guard(m_exports_lock);
+            m_exporting.insert(hdl);
+        }
+        con->defer_http_response();
+        websocketpp::lib::shared_ptr<export_stream> stream(new export_stream(con));
+        thread exporter(bind(&broadcast_server::stream_export,this,stream,query,format));
+        exporter.detach();
+    }
+
+    std::string export_query(const std::string& table) {
+        // user_account is exported without the password column
+        if (table == "user_account") {
+            return "select user_id, username, firstname, lastname, supervisor_id, user_start_date, user_end_date, user_status, skill_id from user_account";
+        } else if (table == "roles") {
+            return "select role_id, role_name, role_description, role_start_date, role_end_date from roles";
+        } else if (table == "user_role") {
+            return "select user_role_id, role_id, user_id, user_role_start_date, user_role_end_date from user_role";
+        } else if (table == "work_skill") {
+            return "select skill_id, skill_name from work_skill";
+        }
+        return "";
+    }
+
+    static void append_json_string(std::string& out, const char* value, unsigned long length) {
+        out += '"';
+        for (unsigned long i = 0; i < length; i++) {
+            unsigned char c = value[i];
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    static void append_csv_field(std::string& out, const char* value, unsigned long length) {
+        std::string field(value, length);
+        if (field.find_first_of(",\"\r\n") == std::string::npos) {
+            out += field;
+            return;
+        }
+        out += '"';
+        for (size_t i = 0; i < field.size(); i++) {
+            if (field[i] == '"') {
+                out += '"';
+            }
+            out += field[i];
+        }
+        out += '"';
+    }
+
+    bool export_push(websocketpp::lib::shared_ptr<export_stream> stream, const std::string& data) {
+        /*
+        Function to queue data for the client of an export. Blocks while
+        export_stream::max_buffered_bytes are waiting to be written, so a
+        slow client slows the export down instead of growing the buffer.
+        return: false once a write has failed and the export should stop
+        */
+        unique_lock<mutex> lock(stream->lock);
+        while (stream->buffered_bytes >= export_stream::max_buffered_bytes && !stream->failed) {
+            stream->space.wait(lock);
+        }
+        if (stream->failed) {
+            return false;
+        }
+        stream->pending.push(data);
+        stream->buffered_bytes += data.size();
+        if (!stream->writing) {
+            stream->writing = true;
+            m_server.get_io_service().post(bind(&broadcast_server::export_write_next,this,stream));
+        }
+        return true;
+    }
+
+    bool export_chunk(websocketpp::lib::shared_ptr<export_stream> stream, const std::string& data) {
+        // one chunk of a chunked transfer encoding body, empty data ends it
+        char size_line[24];
+        snprintf(size_line, sizeof(size_line), "%lx\r\n", static_cast<unsigned long>(data.size()));
+        return export_push(stream, size_line + data + "\r\n");
+    }
+
+    void export_close(websocketpp::lib::shared_ptr<export_stream> stream) {
+        // the reader is done, the connection ends once the buffer is written
+        lock_guard<mutex> guard(stream->lock);
+        stream->done = true;
+        if (!stream->writing) {
+            stream->writing = true;
+            m_server.get_io_service().post(bind(&broadcast_server::export_write_next,this,stream));
+        }
+    }
+
+    void export_write_next(websocketpp::lib::shared_ptr<export_stream> stream) {
+        /*
+        Function run on the asio loop to write the next queued piece of an
+        export. Only one write is in flight per export, and nothing else
+        uses the socket of a deferred HTTP response, so the TLS stream is
+        never used from two threads at once.
+        */
+        unique_lock<mutex> lock(stream->lock);
+        if (!stream->failed && !stream->pending.empty()) {
+            stream->in_flight.swap(stream->pending.front());
+            stream->pending.pop();
+            lock.unlock();
+            websocketpp::lib::asio::async_write(stream->con->get_socket(), websocketpp::lib::asio::buffer(stream->in_flight),
+                bind(&broadcast_server::export_written,this,stream,::_1));
+            return;
+        }
+        stream->writing = false;
+        if (!stream->done) {
+            // the reader posts again when it queues more
+            return;
+        }
+        lock.unlock();
+        finish_export(stream);
+    }
+
+    void export_written(websocketpp::lib::shared_ptr<export_stream> stream, websocketpp::lib::asio::error_code const & ec) {
+        {
+            lock_guard<mutex> guard(stream->lock);
+            stream->buffered_bytes -= stream->in_flight.size();
+            stream->in_flight.clear();
+            if (ec) {
+                stream->failed = true;
+            }
+        }
+        stream->space.notify_all();
+        export_write_next(stream);
+    }
+
+    void stream_export(websocketpp::lib::shared_ptr<export_stream> stream, std::string query, std::string format) {
+        /*
+        Function to stream the rows of query to an HTTP client as NDJSON or
+        CSV. Rows come from mysql_use_result one at a time and are handed to
+        the asio loop in chunks of at most export_chunk_bytes.
+        */
+        static const size_t export_chunk_bytes = 64 * 1024;
+        bool csv = format == "csv";
+
+        std::string header = std::string("HTTP/1.1 200 OK\r\n") +
+            "Content-Type: " + (csv ? "text/csv" : "application/x-ndjson") + "\r\n" +
+            "Transfer-Encoding: chunked\r\n" +
+            "Connection: close\r\n\r\n";
+        bool ok = export_push(stream, header);
+
+        MYSQL *conn = ok ? create_read_connection() : NULL;
+        MYSQL_RES *res = conn == NULL ? NULL : execute_query(conn, query);
+        ok = ok && res != NULL;
+        bool rows_left = false;
+        if (ok) {
+            unsigned int field_count = mysql_num_fields(res);
+            MYSQL_FIELD *fields = mysql_fetch_fields(res);
+            std::string buffer;
+            buffer.reserve(export_chunk_bytes + 4096);
+
+            if (csv) {
+                for (unsigned int i = 0; i < field_count; i++) {
+                    buffer += i ? "," : "";
+                    append_csv_field(buffer, fields[i].name, strlen(fields[i].name));
+                }
+                buffer += "\r\n";
+            }
+
+            MYSQL_ROW row;
+            while (ok && (row = mysql_fetch_row(res)) != NULL) {
+                unsigned long *lengths = mysql_fetch_lengths(res);
+                for (unsigned int i = 0; i < field_count; i++) {
+                    if (csv) {
+                        buffer += i ? "," : "";
+                        if (row[i]) {
+                            append_csv_field(buffer, row[i], lengths[i]);
+                        }
+                    } else {
+                        buffer += i ? "," : "{";
+                        append_json_string(buffer, fields[i].name, strlen(fields[i].name));
+                        buffer += ':';
+                        if (row[i]) {
+                            append_json_string(buffer, row[i], lengths[i]);
+                        } else {
+                            buffer += "null";
+                        }
+                    }
+                }
+                buffer += csv ? "\r\n" : "}\n";
+                if (buffer.size() >= export_chunk_bytes) {
+                    ok = export_chunk(stream, buffer);
+                    buffer.clear();
+                }
+            }
+            rows_left = row != NULL;
+            // a lost connection or KILL QUERY also ends the rows with NULL;
+            // leaving out the last chunk tells the client the body is cut short
+            if (ok && mysql_errno(conn) != 0) {
+                ok = false;
+            }
+            if (ok && !buffer.empty()) {
+                ok = export_chunk(stream, buffer);
+            }
+            if (ok) {
+                export_chunk(stream, "");
+            }
+        }
+        if (!ok) {
+            LOG_WARNING("export aborted: " << query);
+        }
+
+        // freeing an unbuffered result reads the rows it has left, so cancel
+        // the statement first when the client went away mid-export. The
+        // result reads from its connection and is freed before it.
+        if (rows_left) {
+            m_db.kill_query(conn->host ? conn->host : "localhost", conn->port, mysql_thread_id(conn));
+        }
+        if (res != NULL) {
+            mysql_free_result(res);
+        }
+        if (conn != NULL) {
+            close_database_connection(conn);
+        }
+        m_active_exports.fetch_sub(1);
+        export_close(stream);
+    }
+
+    void finish_export(websocketpp::lib::shared_ptr<export_stream> stream) {
+        // The body was written outside websocketpp's HTTP response, so end
+        // the connection the way websocketpp ends it after a response: with
+        // http_connection_ended, which shuts the socket (and TLS) down and
+        // releases the connection without calling the fail handler.
+        lock_guard<mutex> guard(m_exports_lock);
+        m_exporting.erase(stream->con->get_handle());
+        stream->con->terminate(websocketpp::error::make_error_code(websocketpp::error::http_connection_ended));
+    }
+
+    response_cache::payload_ptr perform_action_with_deadline(const rapidjson::Document& parsed_response_json, connection_hdl hdl) {
+        /*
+        Function to run an action under its deadline
+        return: the action response, or a timeout error of the form
+        {"action":"user_list", "status":"False", "error":"timeout"}
+        */
+        std::string action = parsed_response_json["action"].GetString();
+        begin_deadline(action);
+        response_cache::payload_ptr response;
+        try {
+            response = compare_and_perform_action(parsed_response_json, hdl);
+        } catch (const deadline_exceeded &) {
+            if(request_wrote()){
+                finish_write(hdl);
+            }
+            read_from_primary() = false;
+            response.reset(new std::string("{\"action\":\""+action+"\", \"status\":\"False\", \"error\":\"timeout\"}"));
+        }
+        end_deadline();
+        return response;
+    }
+
+    void send_message(connection_hdl hdl, response_cache::payload_ptr payload,
+            websocketpp::frame::opcode::value opcode, outbound_kind kind, uint64_t trace_id = 0) {
+        /*
+        Function to queue a message on the outbound queue of a connection and
+        apply the slow consumer policy. Messages are written by flush_outbound
+        on the asio thread; everything queued while a flush is pending goes
+        out in that flush, where websocketpp gathers the frames that pile up
+        behind an in-progress write into one vectored write. The sent phase
+        of a traced reply is recorded there.
+        */
+        websocketpp::lib::error_code ec;
+        server::connection_ptr con = m_server.get_con_from_hdl(hdl, ec);
+        if (ec) {
+            return;
+        }
+        outbound_message message;
+        message.payload = payload;
+        message.opcode = opcode;
+        message.trace_id = trace_id;
+
+        switch (m_connections.enqueue(hdl, message, kind, con->get_buffered_amount(), m_send_soft_limit, m_send_hard_limit)) {
+        case ENQUEUE_FLUSH:
+            m_server.get_io_service().post(bind(&broadcast_server::flush_outbound,this,hdl));
+            break;
+        case ENQUEUE_DROPPED:
+            m_dropped_notifications.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case ENQUEUE_OVER_LIMIT:
+            m_slow_consumer_disconnects.fetch_add(1, std::memory_order_relaxed);
+            LOG_WARNING("closing slow consumer " << con->get_remote_endpoint());
+            m_server.close(hdl, websocketpp::close::status::try_again_later, "slow consumer", ec);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void flush_outbound(connection_hdl hdl) {
+        std::vector<outbound_message> messages;
+        m_connections.take_outbound(hdl, messages);
+
+        websocketpp::lib::error_code ec;
+        for (size_t i = 0; i < messages.size() && !ec; i++) {
+            m_server.send(hdl, *messages[i].payload, messages[i].opcode, ec);
+            if (!ec) {
+                m_tracer.record(messages[i].trace_id, TRACE_SENT);
+            }
+        }
+        if (ec) {
+            LOG_ERROR("send failed: " << ec.message());
+        }
+
+        // only one flush per connection runs at a time, even with several
+        // io threads, so frames go out in the order they were queued. A
+        // new round is posted rather than looping to keep this io thread fair
+        if (m_connections.finish_flush(hdl)) {
+            m_server.get_io_service().post(bind(&broadcast_server::flush_outbound,this,hdl));
+        }
+    }
+
     std::string convert_vector_to_string_for_response(std::vector <std::string> response_array){
         /*
         Function to convert a vector of strings to a json string
@@ -173,17 +2883,205 @@ public:
 
     MYSQL* create_database_connection(){
        /*
-       Function to create a mysql database connection 
+       Function to create a mysql database connection to the primary, used
+       for writes and for reads that must see the latest data
+       return: connection instance
+       */
+       return track_connection(m_db.connect_primary());
+    }
+
+    MYSQL* create_read_connection(){
+       /*
+       Function to create a mysql database connection for a read. Goes to a
+       replica unless the current request is pinned to the primary.
        return: connection instance
        */
-       MYSQL *conn;
-       const char *server = "localhost";
-       const char *user = "root";
-       const char *password = "password";
-       const char *database = "demo";
-       conn = mysql_init(NULL);
-       conn = mysql_real_connect(conn, server, user, password, database, 0, NULL, 0);
-       return(conn);
+       if(read_from_primary()){
+           return track_connection(m_db.connect_primary());
+       }
+       return track_connection(m_db.connect_replica());
+    }
+
+    static deadline_slot*& current_deadline_slot(){
+        // slot of the worker running on the calling thread, NULL elsewhere
+        static thread_local deadline_slot* slot = NULL;
+        return slot;
+    }
+
+    MYSQL* track_connection(MYSQL* conn){
+        // let the watchdog cancel statements on conn if the request runs late
+        deadline_slot* slot = current_deadline_slot();
+        if(slot != NULL && conn != NULL){
+            tracked_connection tracked;
+            tracked.conn = conn;
+            tracked.host = conn->host ? conn->host : "localhost";
+            tracked.port = conn->port;
+            tracked.thread_id = mysql_thread_id(conn);
+            lock_guard<mutex> guard(slot->lock);
+            slot->connections.push_back(tracked);
+        }
+        return conn;
+    }
+
+    void close_database_connection(MYSQL* conn){
+        /*
+        Function to close a connection made by create_database_connection or
+        create_read_connection. Throws deadline_exceeded when the last
+        statement on conn failed after the request ran past its deadline,
+        i.e. the watchdog cancelled it and any rows read from it are cut
+        short. A statement that completed is never reported as a timeout.
+        */
+        deadline_slot* slot = current_deadline_slot();
+        bool expired = false;
+        if(slot != NULL){
+            lock_guard<mutex> guard(slot->lock);
+            for(size_t i=0; i<slot->connections.size(); i++){
+                if(slot->connections[i].conn == conn){
+                    slot->connections.erase(slot->connections.begin() + i);
+                    break;
+                }
+            }
+            expired = slot->expired;
+        }
+        bool interrupted = expired && conn != NULL && mysql_errno(conn) != 0;
+        mysql_close(conn);
+        if(interrupted){
+            throw deadline_exceeded();
+        }
+    }
+
+    void begin_deadline(const std::string& action){
+        deadline_slot* slot = current_deadline_slot();
+        long deadline_ms = m_deadlines.deadline_for(action);
+        lock_guard<mutex> guard(slot->lock);
+        slot->action = action;
+        slot->expired = false;
+        slot->deadline_ms = deadline_ms > 0 ? steady_now_ms() + deadline_ms : 0;
+    }
+
+    void end_deadline(){
+        // closes whatever the request left open when it unwound early
+        deadline_slot* slot = current_deadline_slot();
+        std::vector<tracked_connection> leftover;
+        {
+            lock_guard<mutex> guard(slot->lock);
+            slot->deadline_ms = 0;
+            leftover.swap(slot->connections);
+        }
+        for(size_t i=0; i<leftover.size(); i++){
+            mysql_close(leftover[i].conn);
+        }
+    }
+
+    static bool deadline_expired(){
+        deadline_slot* slot = current_deadline_slot();
+        if(slot == NULL){
+            return false;
+        }
+        lock_guard<mutex> guard(slot->lock);
+        return slot->expired;
+    }
+
+    static bool& read_from_primary(){
+        // set while the calling thread serves a request pinned to the primary
+        static thread_local bool pinned = false;
+        return pinned;
+    }
+
+    static bool& request_wrote(){
+        // set by note_change when the request on the calling thread wrote
+        static thread_local bool wrote = false;
+        return wrote;
+    }
+
+    static bool& read_failed(){
+        // set when a list read on the calling thread failed or was cut short
+        static thread_local bool failed = false;
+        return failed;
+    }
+
+    static void note_read_result(MYSQL* conn, MYSQL_RES* res){
+        // a dropped connection also ends the rows with NULL, so check errno
+        if(conn == NULL || res == NULL || mysql_errno(conn) != 0){
+            read_failed() = true;
+        }
+    }
+
+    static std::string& written_table(){
+        // table of the last write made by the request on the calling thread
+        static thread_local std::string table;
+        return table;
+    }
+
+    void finish_write(connection_hdl hdl){
+        /*
+        Function to pin the writer to the primary and record the written
+        table for the next change notification
+        */
+        m_connections.note_write(hdl);
+        if(m_change_notify_ms > 0){
+            lock_guard<mutex> guard(m_notify_lock);
+            m_changed_tables.insert(written_table());
+        }
+    }
+
+    void change_notifier_loop(){
+        /*
+        Function to send every logged in connection one notification per
+        table written since the last round:
+        {"action":"data_changed", "table":"user_account"}
+        Writers are told about their own writes too. The notifications are
+        the first thing dropped for slow consumers.
+        */
+        while(m_change_notify_ms > 0){
+            std::this_thread::sleep_for(std::chrono::milliseconds(m_change_notify_ms));
+            std::set<std::string> tables;
+            {
+                lock_guard<mutex> guard(m_notify_lock);
+                tables.swap(m_changed_tables);
+            }
+            if(tables.empty()){
+                continue;
+            }
+            connection_registry::hdl_list hdls;
+            m_connections.sessions(hdls);
+            for(std::set<std::string>::const_iterator it = tables.begin(); it != tables.end(); ++it){
+                response_cache::payload_ptr payload(new std::string(
+                    "{\"action\":\"data_changed\", \"table\":\""+*it+"\"}"));
+                for(size_t i=0; i<hdls.size(); i++){
+                    send_message(hdls[i], payload, websocketpp::frame::opcode::text, OUTBOUND_NOTIFICATION);
+                }
+            }
+        }
+    }
+
+    static uint64_t& current_trace_id(){
+        // trace id of the request the calling thread is working on
+        static thread_local uint64_t trace_id = 0;
+        return trace_id;
+    }
+
+    std::string dump_trace(std::string format){
+        /*
+        Function to export the trace rings to m_trace_path as a Chrome trace
+        (format "chrome", the default) or as compact binary (format "binary")
+        return : json string with action, status and event count
+        {"action":"trace_dump", "status":"True", "events":"120", "file":"trace.json"}
+        */
+        std::vector<trace_event> events = m_tracer.events();
+        std::string path = m_trace_path + (format == "binary" ? ".bin" : ".json");
+        bool written = format == "binary" ? request_tracer::write_binary(path, events) : request_tracer::write_chrome_trace(path, events);
+
+        std::vector <std::string> response_array;
+        response_array.push_back("action");
+        response_array.push_back("trace_dump");
+        response_array.push_back("status");
+        response_array.push_back(written ? "True" : "False");
+        response_array.push_back("events");
+        response_array.push_back(std::to_string(events.size()));
+        response_array.push_back("file");
+        response_array.push_back(path);
+        return convert_vector_to_string_for_response(response_array);
     }
 
     MYSQL_RES* execute_query(MYSQL* conn, std::string query){
@@ -195,22 +3093,67 @@ public:
         */
         MYSQL_RES *res;
         const char *q = query.c_str();
+        if(conn == NULL){
+            return(NULL);
+        }
+        if(deadline_expired()){
+            throw deadline_exceeded();
+        }
+        m_tracer.record(current_trace_id(), TRACE_QUERY_START);
         int state = mysql_query(conn, q);
         res = mysql_use_result(conn);
+        m_tracer.record(current_trace_id(), TRACE_QUERY_END);
         if(state==0){
           return(res);
         }
+        else if(deadline_expired()){
+          throw deadline_exceeded();
+        }
         else{
-          std::cout<<"ERROR:"<<mysql_error(conn)<<std::endl;
+          LOG_ERROR("query failed: " << mysql_error(conn));
+          return(NULL);
         }
     }    
 
-    std::string log_in(std::string username,std::string userpassword){
+    bool execute_write(MYSQL* conn, const std::string& query, unsigned long long* rows_matched = NULL){
+        /*
+        Function to execute an insert, update or delete. These return no
+        result set, so success is taken from mysql_query itself.
+        rows_matched receives the rows the statement matched; connections are
+        made with CLIENT_FOUND_ROWS, so an update that leaves a row unchanged
+        still counts it.
+        return: true when the statement succeeded
+        */
+        if(conn == NULL){
+            return false;
+        }
+        if(deadline_expired()){
+            throw deadline_exceeded();
+        }
+        m_tracer.record(current_trace_id(), TRACE_QUERY_START);
+        int state = mysql_query(conn, query.c_str());
+        m_tracer.record(current_trace_id(), TRACE_QUERY_END);
+        if(state == 0){
+            if(rows_matched != NULL){
+                *rows_matched = mysql_affected_rows(conn);
+            }
+            return true;
+        }
+        if(deadline_expired()){
+            // the watchdog cancelled the statement, nothing was written
+            throw deadline_exceeded();
+        }
+        LOG_ERROR("write failed: " << mysql_error(conn));
+        return false;
+    }
+
+    std::string log_in(std::string username,std::string userpassword, std::string& session_token){
         /*
         Function to log in the user, validate if the user exists in the database, if so 
         generate a unique token else return an error as user not found
         param: username of user.
         param: password of user.
+        param: set to the generated token when the log in succeeds.
         return: Response json in string.
         */
 
@@ -221,6 +3164,8 @@ public:
         std::string status = "False";
         std::string query;
 
+        // always check credentials on the primary, a lagging replica would
+        // still accept a changed password or a deleted user
         conn = create_database_connection();
         query = "select * from user_account where username = '"+username+"' and password = '"+userpassword+"'";
         res = execute_query(conn, query);
@@ -231,10 +3176,13 @@ public:
         else{                                                                                               
             status = "True";
         }
-        mysql_close(conn);
+        close_database_connection(conn);
 
         std::string token = generate_random_string();
         std::string message = std::string("Welcome to Oracle.");
+        if(status == "True"){
+            session_token = token;
+        }
         
         std::vector <std::string> response_array;
         response_array.push_back("token"); 
@@ -263,13 +3211,13 @@ public:
         */
         MYSQL_RES *res;
         MYSQL_ROW row;
-        MYSQL *conn = create_database_connection();
+        MYSQL *conn = create_read_connection();
         std::string query = "select user_id, username from user_account";
         std::string response_string;
         std::vector<std::tuple<std::string, std::string>> supervisor_user_list; 
        
         res = execute_query(conn, query);
-        while((row = mysql_fetch_row(res))!=NULL){
+        while(res && (row = mysql_fetch_row(res))!=NULL){
             //vector of tuples of the form (user_id, username)
             supervisor_user_list.push_back(std::make_tuple(row[0], row[1]));
         }
@@ -282,6 +3230,9 @@ public:
                 response_string += ",";
             }
         }
+        note_read_result(conn, res);
+        mysql_free_result(res);
+        close_database_connection(conn);
         response_string += "]";
         
         return response_string;
@@ -299,13 +3250,13 @@ public:
         */
         MYSQL_RES *res;
         MYSQL_ROW row;
-        MYSQL *conn = create_database_connection();
+        MYSQL *conn = create_read_connection();
         std::string query = "select skill_id, skill_name from work_skill";
         std::string response_string;
         std::vector<std::tuple<std::string, std::string>> user_skill_list; 
         
         res = execute_query(conn, query);     
-        while((row = mysql_fetch_row(res))!=NULL){
+        while(res && (row = mysql_fetch_row(res))!=NULL){
             //vector of tuples of the form (user_id, username)
             user_skill_list.push_back(std::make_tuple(row[0], row[1]));
         }
@@ -318,6 +3269,9 @@ public:
                 response_string += ",";
             }
         }
+        note_read_result(conn, res);
+        mysql_free_result(res);
+        close_database_connection(conn);
         response_string += "]";
       
         return response_string;       
@@ -359,71 +3313,106 @@ public:
         
         */
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
         
         conn = create_database_connection();     
         std::string query = "insert into user_account(username, firstname, lastname, password, supervisor_id, user_start_date, user_end_date, user_status, skill_id) values ('"+username+"','"+firstname+"','"+lastname+"','"+userpassword+"','"+supervisor_id+"','"+user_start_date+"','"+user_end_date+"','"+user_status+"','"+skill_id+"')";
-        res = execute_query(conn, query);
-        if(res){
+        bool written = execute_write(conn, query);
+        if(!written){
             response = "{\"action\":\"user_create\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"user_create\", \"status\":\"True\"}";
+            user_search_entry entry;
+            entry.user_id = std::to_string(mysql_insert_id(conn));
+            // a new row is only known once committed, lock it for the index update
+            lock_guard<mutex> row_guard(m_row_locks.for_row("user_account", entry.user_id));
+            lock_guard<mutex> guard(m_change_lock);
+
+            entry.username = username;
+            entry.firstname = firstname;
+            entry.lastname = lastname;
+            m_user_search_index.insert(entry);
+            m_org_chart_index.set_supervisor(entry.user_id, supervisor_key(supervisor_id));
+            note_change("user_account");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string edit_user(std::string user_id, std::string username, std::string firstname, std::string lastname, std::string userpassword, std::string supervisor_id, std::string user_start_date, std::string user_end_date, std::string user_status, std::string skill_id){
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
+        if(!parse_id(user_id, user_id)){
+            return "{\"action\":\"user_edit\", \"status\":\"False\"}";
+        }
         
         conn = create_database_connection();     
         std::string query = "update user_account set username = \""+username+"\", firstname=\""+firstname+"\", lastname=\""+lastname+"\", password=\""+userpassword+"\", supervisor_id =\""+supervisor_id+"\", user_start_date = \""+user_end_date+"\", user_end_date = \""+user_end_date+"\", user_status = \""+user_status+"\", skill_id = \""+skill_id+"\" where user_id="+user_id;
-        res = execute_query(conn, query);
-        if(res){
+        // the write and its index update happen as one step, see row_locks
+        lock_guard<mutex> row_guard(m_row_locks.for_row("user_account", user_id));
+        unsigned long long rows_matched = 0;
+        bool written = execute_write(conn, query, &rows_matched);
+        // an update of a missing user succeeds without matching a row
+        if(!written || rows_matched == 0){
             response = "{\"action\":\"user_edit\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"user_edit\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+
+            user_search_entry entry;
+            entry.user_id = user_id;
+            entry.username = username;
+            entry.firstname = firstname;
+            entry.lastname = lastname;
+            m_user_search_index.insert(entry);
+            m_org_chart_index.set_supervisor(user_id, supervisor_key(supervisor_id));
+            note_change("user_account");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string delete_user(std::string user_id){
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
+        if(!parse_id(user_id, user_id)){
+            return "{\"action\":\"user_delete\", \"status\":\"False\"}";
+        }
         
         conn = create_database_connection();     
         std::string query = "delete from user_account where user_id="+user_id;
-        res = execute_query(conn, query);
-        if(res){
+        // the write and its index update happen as one step, see row_locks
+        lock_guard<mutex> row_guard(m_row_locks.for_row("user_account", user_id));
+        bool written = execute_write(conn, query);
+        if(!written){
             response = "{\"action\":\"user_delete\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"user_delete\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+            m_user_search_index.remove(user_id);
+            m_org_chart_index.remove(user_id);
+            note_change("user_account");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string list_user(){
         MYSQL_RES *res;
         MYSQL_ROW row;
-        MYSQL *conn = create_database_connection();
+        MYSQL *conn = create_read_connection();
         std::string query = "select user_id, username, firstname, lastname, password, supervisor_id, user_start_date, user_end_date, user_status, skill_id from user_account";
         std::string response_string="{\"action\":\"list_user\", \"users\":[";
         std::string user_id, username, firstname, lastname, supervisor_id, user_start_date, user_status, password, user_end_date, skill_id; 
        
         res = execute_query(conn, query);
-        row = mysql_fetch_row(res);
+        row = res ? mysql_fetch_row(res) : NULL;
         while(row !=NULL){
             user_id = row[0];
             username = row[1];
@@ -448,10 +3437,168 @@ public:
             if((row = mysql_fetch_row(res)) != NULL){
                 response_string += ", ";
             }
-            
+            
+        }
+        note_read_result(conn, res);
+        mysql_free_result(res);
+        close_database_connection(conn);
+        response_string += "]}";
+        
+        return response_string;
+    }
+
+    bool fetch_records(std::string query, size_t field_count, std::vector<snapshot_data::record>& records){
+        /*
+        Function to run a select and copy every row into a record of
+        field_count strings, NULL columns become empty strings
+        return: false when the query failed or the rows were cut short
+        */
+        MYSQL_RES *res;
+        MYSQL_ROW row;
+        MYSQL *conn = create_database_connection();
+        if(conn == NULL){
+            return false;
+        }
+
+        res = execute_query(conn, query);
+        if(res == NULL){
+            close_database_connection(conn);
+            return false;
+        }
+        while((row = mysql_fetch_row(res))!=NULL){
+            snapshot_data::record record;
+            for(size_t i=0; i<field_count; i++){
+                record.push_back(row[i] ? row[i] : "");
+            }
+            records.push_back(record);
+        }
+        bool complete = mysql_errno(conn) == 0;
+        mysql_free_result(res);
+        close_database_connection(conn);
+        return complete;
+    }
+
+    bool install_user_indexes(const std::vector<snapshot_data::record>& users, uint64_t version){
+        /*
+        Function to rebuild the user search index and the org chart index
+        from user_account records of the form
+        (user_id, username, firstname, lastname, supervisor_id)
+        version: user_account version read before the records were
+        return: false, leaving the indexes untouched, when a write to
+        user_account happened after version was read
+        */
+        user_search_index search_index;
+        org_chart_index org_chart;
+        for(size_t i=0; i<users.size(); i++){
+            user_search_entry entry;
+            entry.user_id = users[i][0];
+            entry.username = users[i][1];
+            entry.firstname = users[i][2];
+            entry.lastname = users[i][3];
+            search_index.insert(entry);
+            org_chart.set_supervisor(entry.user_id, users[i][4]);
+        }
+
+        lock_guard<mutex> guard(m_change_lock);
+        if(version != m_table_versions["user_account"]){
+            return false;
+        }
+        m_user_search_index.swap(search_index);
+        m_org_chart_index.swap(org_chart);
+        return true;
+    }
+
+    bool load_user_indexes(){
+        /*
+        Function to populate the user search index and the org chart index
+        from user_account
+        */
+        uint64_t version = current_table_version("user_account");
+        std::vector<snapshot_data::record> users;
+        return fetch_records("select user_id, username, firstname, lastname, supervisor_id from user_account", 5, users) &&
+            install_user_indexes(users, version);
+    }
+
+    std::string search_user(std::string search_query, size_t limit){
+        /*
+        Function to return the top matches for a typeahead query from the
+        in-memory user search index
+        returns string in the form:
+        {
+            "action":"user_search",
+            "users":
+            [
+                {"user_id":"12", "username":"user0", "firstname":"..", "lastname":".."},..
+            ]
+        }
+        */
+        std::vector<user_search_entry> matches = m_user_search_index.search(search_query, limit);
+        std::string response_string = "{\"action\":\"user_search\", \"users\":[";
+        for(size_t i=0; i<matches.size(); i++){
+            response_string += "{\"user_id\":\""+matches[i].user_id+
+            "\",\"username\":\""+matches[i].username+
+            "\",\"firstname\":\""+matches[i].firstname+
+            "\",\"lastname\":\""+matches[i].lastname+"\"}";
+            if(i+1 < matches.size()){
+                response_string += ", ";
+            }
         }
         response_string += "]}";
-        
+        return response_string;
+    }
+
+    std::string id_list_in_json_format(std::string key, const std::vector<std::string>& user_ids){
+        /*
+        Function to convert a list of ids to json format
+        returns string in the form :
+
+        "key":["12", "13"]
+        */
+        std::string response_string = "\""+key+"\":[";
+        for(size_t i=0; i<user_ids.size(); i++){
+            response_string += "\""+user_ids[i]+"\"";
+            if(i+1 < user_ids.size()){
+                response_string += ",";
+            }
+        }
+        response_string += "]";
+        return response_string;
+    }
+
+    static std::string supervisor_key(const std::string& supervisor_id){
+        // the org chart key MySQL stores for a client supervisor_id; anything
+        // that is not an id is stored as no supervisor
+        std::string id;
+        return parse_id(supervisor_id, id) ? id : "";
+    }
+
+    std::string user_hierarchy(std::string action, std::string user_id){
+        /*
+        Function to answer a reporting tree query for user_id from the
+        in-memory org chart index
+        returns string in the form:
+        {"action":"user_direct_reports", "user_id":"12", "users":["13","14"]}
+        or for user_subtree_size:
+        {"action":"user_subtree_size", "user_id":"12", "subtree_size":"3"}
+        */
+        if(!parse_id(user_id, user_id)){
+            return "{\"action\":\""+action+"\", \"status\":\"False\"}";
+        }
+        std::string response_string = "{\"action\":\""+action+"\", \"user_id\":\""+user_id+"\", ";
+
+        if(action == "user_direct_reports"){
+            response_string += id_list_in_json_format("users", m_org_chart_index.direct_reports(user_id));
+        }
+        else if(action == "user_all_reports"){
+            response_string += id_list_in_json_format("users", m_org_chart_index.all_reports(user_id));
+        }
+        else if(action == "user_management_chain"){
+            response_string += id_list_in_json_format("users", m_org_chart_index.management_chain(user_id));
+        }
+        else{
+            response_string += "\"subtree_size\":\""+std::to_string(m_org_chart_index.subtree_size(user_id))+"\"";
+        }
+        response_string += "}";
         return response_string;
     }
 
@@ -464,75 +3611,96 @@ public:
         
         */
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
 
         conn = create_database_connection(); 
         std::string query = "insert into roles(role_name, role_description, role_start_date, role_end_date) values ('"+role_name+"','"+role_description+"','"+role_start_date+"','"+role_end_date+"')";
-        res = execute_query(conn, query);
+        bool written = execute_write(conn, query);
         
-        if(res){
+        if(!written){
             response = "{\"action\":\"role_create\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"role_create\", \"status\":\"True\"}";
+            std::string new_role_id = std::to_string(mysql_insert_id(conn));
+            // a new row is only known once committed, lock it for the index update
+            lock_guard<mutex> row_guard(m_row_locks.for_row("roles", new_role_id));
+            lock_guard<mutex> guard(m_change_lock);
+            m_role_membership_index.set_role(new_role_id, role_start_date, role_end_date);
+            note_change("roles");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string edit_role(std::string role_id, std::string role_name, std::string role_description, std::string role_start_date, std::string role_end_date){
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
+        if(!parse_id(role_id, role_id)){
+            return "{\"action\":\"role_edit\", \"status\":\"False\"}";
+        }
 
         conn = create_database_connection(); 
         std::string query = "update roles set role_name = \""+role_name+"\", role_description=\""+role_description+"\", role_start_date=\""+role_start_date+"\", role_end_date=\""+role_end_date+"\" where role_id="+role_id;
-        res = execute_query(conn, query);
+        // the write and its index update happen as one step, see row_locks
+        lock_guard<mutex> row_guard(m_row_locks.for_row("roles", role_id));
+        unsigned long long rows_matched = 0;
+        bool written = execute_write(conn, query, &rows_matched);
         
-        if(res){
+        // an update of a missing row succeeds without matching it
+        if(!written || rows_matched == 0){
             response = "{\"action\":\"role_edit\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"role_edit\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+            m_role_membership_index.set_role(role_id, role_start_date, role_end_date);
+            note_change("roles");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string delete_role(std::string role_id){
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
+        if(!parse_id(role_id, role_id)){
+            return "{\"action\":\"role_delete\", \"status\":\"False\"}";
+        }
         
         conn = create_database_connection();     
         std::string query = "delete from roles where role_id="+role_id;
-        res = execute_query(conn, query);
-        if(res){
+        // the write and its index update happen as one step, see row_locks
+        lock_guard<mutex> row_guard(m_row_locks.for_row("roles", role_id));
+        bool written = execute_write(conn, query);
+        if(!written){
             response = "{\"action\":\"role_delete\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"role_delete\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+            m_role_membership_index.remove_role(role_id);
+            note_change("roles");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string list_role(){
         MYSQL_RES *res;
         MYSQL_ROW row;
-        MYSQL *conn = create_database_connection();
+        MYSQL *conn = create_read_connection();
         std::string query = "select role_id, role_name, role_description, role_start_date, role_end_date from roles";
         std::string response_string="{\"action\":\"list_role\", \"roles\":[";
         std::string role_id, role_name, role_description, role_start_date, role_end_date; 
        
         res = execute_query(conn, query);
-        row = mysql_fetch_row(res);
+        row = res ? mysql_fetch_row(res) : NULL;
         while(row !=NULL){
-            std::cout<<"\n\n\nhi\n\n\\n";
+            LOG_DEBUG("list_role row " << row[0]);
             role_id = row[0];
             role_name = row[1];
             role_description = row[2];
@@ -548,6 +3716,9 @@ public:
             }
             
         }
+        note_read_result(conn, res);
+        mysql_free_result(res);
+        close_database_connection(conn);
         response_string += "]}";
         
         return response_string;
@@ -562,74 +3733,111 @@ public:
         
         */
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
+        if(!parse_id(role_id, role_id) || !parse_id(user_id, user_id)){
+            return "{\"action\":\"user_role_create\", \"status\":\"False\"}";
+        }
 
         conn = create_database_connection(); 
         std::string query = "insert into user_role(role_id, user_id, user_role_start_date, user_role_end_date) values ('"+role_id+"','"+user_id+"','"+user_role_start_date+"','"+user_role_end_date+"')";
-        res = execute_query(conn, query);
+        bool written = execute_write(conn, query);
         
-        if(res){
+        if(!written){
             response = "{\"action\":\"user_role_create\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"user_role_create\", \"status\":\"True\"}";
+            role_assignment assignment;
+            assignment.user_role_id = std::to_string(mysql_insert_id(conn));
+            // a new row is only known once committed, lock it for the index update
+            lock_guard<mutex> row_guard(m_row_locks.for_row("user_role", assignment.user_role_id));
+            lock_guard<mutex> guard(m_change_lock);
+
+            assignment.role_id = role_id;
+            assignment.user_id = user_id;
+            assignment.start_date = user_role_start_date;
+            assignment.end_date = user_role_end_date;
+            m_role_membership_index.set_assignment(assignment);
+            note_change("user_role");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string edit_user_role(std::string user_role_id, std::string role_id, std::string user_id, std::string user_role_start_date, std::string user_role_end_date){
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
+        if(!parse_id(user_role_id, user_role_id) || !parse_id(role_id, role_id) || !parse_id(user_id, user_id)){
+            return "{\"action\":\"user_role_edit\", \"status\":\"False\"}";
+        }
 
         conn = create_database_connection(); 
         std::string query = "update user_role set role_id = \""+role_id+"\", user_id=\""+user_id+"\", user_role_start_date=\""+user_role_start_date+"\", user_role_end_date=\""+user_role_end_date+"\" where user_role_id="+user_role_id;
-        res = execute_query(conn, query);
+        // the write and its index update happen as one step, see row_locks
+        lock_guard<mutex> row_guard(m_row_locks.for_row("user_role", user_role_id));
+        unsigned long long rows_matched = 0;
+        bool written = execute_write(conn, query, &rows_matched);
         
-        if(res){
+        // an update of a missing row succeeds without matching it
+        if(!written || rows_matched == 0){
             response = "{\"action\":\"user_role_edit\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"user_role_edit\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+
+            role_assignment assignment;
+            assignment.user_role_id = user_role_id;
+            assignment.role_id = role_id;
+            assignment.user_id = user_id;
+            assignment.start_date = user_role_start_date;
+            assignment.end_date = user_role_end_date;
+            m_role_membership_index.set_assignment(assignment);
+            note_change("user_role");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string delete_user_role(std::string user_role_id){
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
+        if(!parse_id(user_role_id, user_role_id)){
+            return "{\"action\":\"user_role_delete\", \"status\":\"False\"}";
+        }
 
         conn = create_database_connection(); 
         std::string query = "delete from user_role where user_role_id="+user_role_id;
-        res = execute_query(conn, query);
+        // the write and its index update happen as one step, see row_locks
+        lock_guard<mutex> row_guard(m_row_locks.for_row("user_role", user_role_id));
+        bool written = execute_write(conn, query);
         
-        if(res){
+        if(!written){
             response = "{\"action\":\"user_role_delete\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"user_role_delete\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+            m_role_membership_index.remove_assignment(user_role_id);
+            note_change("user_role");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string list_user_role(){
         MYSQL_RES *res;
         MYSQL_ROW row;
-        MYSQL *conn = create_database_connection();
+        MYSQL *conn = create_read_connection();
         std::string query = "select user_role_id, role_id, user_id, user_role_start_date, user_role_end_date from user_role";
         std::string response_string="{\"action\":\"list_user_role\", \"user_roles\":[";
         std::string user_role_id, role_id, user_id, user_role_start_date, user_role_end_date; 
        
         res = execute_query(conn, query);
-        row = mysql_fetch_row(res);
+        row = res ? mysql_fetch_row(res) : NULL;
         while(row !=NULL){
             user_role_id = row[0];
             role_id = row[1];
@@ -646,11 +3854,94 @@ public:
             }
             
         }
+        note_read_result(conn, res);
+        mysql_free_result(res);
+        close_database_connection(conn);
         response_string += "]}";
         
         return response_string;
     }
 
+    bool install_role_membership_index(const std::vector<snapshot_data::record>& roles, const std::vector<snapshot_data::record>& user_roles, uint64_t version){
+        /*
+        Function to rebuild the role membership index from roles records
+        (role_id, role_start_date, role_end_date) and user_role records
+        (user_role_id, role_id, user_id, user_role_start_date, user_role_end_date)
+        version: sum of the roles and user_role versions read before the
+        records were
+        return: false, leaving the index untouched, when a write to either
+        table happened after version was read
+        */
+        role_membership_index membership;
+        for(size_t i=0; i<roles.size(); i++){
+            membership.set_role(roles[i][0], roles[i][1], roles[i][2]);
+        }
+        for(size_t i=0; i<user_roles.size(); i++){
+            role_assignment assignment;
+            assignment.user_role_id = user_roles[i][0];
+            assignment.role_id = user_roles[i][1];
+            assignment.user_id = user_roles[i][2];
+            assignment.start_date = user_roles[i][3];
+            assignment.end_date = user_roles[i][4];
+            membership.set_assignment(assignment);
+        }
+
+        lock_guard<mutex> guard(m_change_lock);
+        if(version != m_table_versions["roles"] + m_table_versions["user_role"]){
+            return false;
+        }
+        m_role_membership_index.swap(membership);
+        return true;
+    }
+
+    bool load_role_membership_index(){
+        /*
+        Function to populate the role membership index from roles and user_role
+        */
+        uint64_t version = current_table_version("roles") + current_table_version("user_role");
+        std::vector<snapshot_data::record> roles;
+        std::vector<snapshot_data::record> user_roles;
+        return fetch_records("select role_id, role_start_date, role_end_date from roles", 3, roles) &&
+            fetch_records("select user_role_id, role_id, user_id, user_role_start_date, user_role_end_date from user_role", 5, user_roles) &&
+            install_role_membership_index(roles, user_roles, version);
+    }
+
+    std::string user_active_roles(std::string user_id, std::string date){
+        /*
+        Function to list the roles user_id holds on date (today when empty)
+        returns string in the form:
+        {"action":"user_active_roles", "user_id":"12", "date":"2020-01-31", "roles":["1","4"]}
+        */
+        if(!parse_id(user_id, user_id)){
+            return "{\"action\":\"user_active_roles\", \"status\":\"False\"}";
+        }
+        if(date.empty()){
+            date = role_membership_index::current_date();
+        }
+        std::string response_string = "{\"action\":\"user_active_roles\", \"user_id\":\""+user_id+"\", \"date\":\""+date+"\", ";
+        response_string += id_list_in_json_format("roles", m_role_membership_index.roles_for_user(user_id, date));
+        response_string += "}";
+        return response_string;
+    }
+
+    std::string role_active_users(std::string role_id, std::string date){
+        /*
+        Function to list the users holding role_id on date (today when empty)
+        returns string in the form:
+        {"action":"role_active_users", "role_id":"1", "date":"2020-01-31", "users":["12","13"]}
+        */
+        if(!parse_id(role_id, role_id)){
+            return "{\"action\":\"role_active_users\", \"status\":\"False\"}";
+        }
+        if(date.empty()){
+            date = role_membership_index::current_date();
+        }
+        std::string response_string = "{\"action\":\"role_active_users\", \"role_id\":\""+role_id+"\", \"date\":\""+date+"\", ";
+        response_string += id_list_in_json_format("users", m_role_membership_index.users_for_role(role_id, date));
+        response_string += "}";
+        return response_string;
+    }
+
     std::string create_skill(std::string skill_name){
         /*
         Function to create a new ROLE from values passed as 
@@ -660,21 +3951,22 @@ public:
         
         */
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
 
         conn = create_database_connection(); 
         std::string query = "insert into work_skill(skill_name) values ('"+skill_name+"')";
-        res = execute_query(conn, query);
+        bool written = execute_write(conn, query);
         
-        if(res){
+        if(!written){
             response = "{\"action\":\"skill_create\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"skill_create\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+            note_change("work_skill");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
@@ -687,21 +3979,22 @@ public:
         
         */
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
 
         conn = create_database_connection(); 
         std::string query = "update work_skill set skill_name = \""+skill_name+"\" where skill_id="+skill_id;
-        res = execute_query(conn, query);
+        bool written = execute_write(conn, query);
         
-        if(res){
+        if(!written){
             response = "{\"action\":\"skill_edit\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"skill_edit\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+            note_change("work_skill");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
@@ -714,34 +4007,35 @@ public:
         
         */
         MYSQL *conn;
-        MYSQL_RES *res;
         MYSQL_ROW row;
         std::string response = "";
 
         conn = create_database_connection(); 
         std::string query = "delete from work_skill where skill_id="+skill_id;
-        res = execute_query(conn, query);
+        bool written = execute_write(conn, query);
         
-        if(res){
+        if(!written){
             response = "{\"action\":\"skill_delete\", \"status\":\"False\"}";
         }
         else{                                                                                               
             response = "{\"action\":\"skill_delete\", \"status\":\"True\"}";
+            lock_guard<mutex> guard(m_change_lock);
+            note_change("work_skill");
         }
-        mysql_close(conn);
+        close_database_connection(conn);
         return response;
     }
 
     std::string list_skill(){
         MYSQL_RES *res;
         MYSQL_ROW row;
-        MYSQL *conn = create_database_connection();
+        MYSQL *conn = create_read_connection();
         std::string query = "select skill_id, skill_name from work_skill";
         std::string response_string="{\"action\":\"skill_list\", \"skills\":[";
         std::string skill_id, skill_name; 
        
         res = execute_query(conn, query);
-        row = mysql_fetch_row(res);
+        row = res ? mysql_fetch_row(res) : NULL;
         while(row !=NULL){
             skill_id = row[0];
             skill_name = row[1];
@@ -752,27 +4046,305 @@ public:
             }
             
         }
+        note_read_result(conn, res);
+        mysql_free_result(res);
+        close_database_connection(conn);
         response_string += "]}";
         
         return response_string;
     }
 
-    std::string compare_and_perform_action(const rapidjson::Document& parsed_response_json){
+    uint64_t current_change_version(){
+        lock_guard<mutex> guard(m_change_lock);
+        return m_change_version;
+    }
+
+    uint64_t current_table_version(const std::string& table){
+        lock_guard<mutex> guard(m_change_lock);
+        return m_table_versions[table];
+    }
+
+    void note_change(const std::string& table){
+        /*
+        Function to record a successful write to table: drops the cached
+        responses built from it and bumps the change version so loads that
+        started before the write do not overwrite it. The per-table version
+        lets index loads ignore writes to unrelated tables. Caller holds
+        m_change_lock.
+        */
+        if(table == "user_account"){
+            m_response_cache.invalidate("user_list");
+            m_response_cache.invalidate("get_user_creation_pop_up_details");
+        }
+        else if(table == "roles"){
+            m_response_cache.invalidate("role_list");
+        }
+        else if(table == "user_role"){
+            m_response_cache.invalidate("user_role_list");
+        }
+        else if(table == "work_skill"){
+            m_response_cache.invalidate("skill_list");
+            m_response_cache.invalidate("get_user_creation_pop_up_details");
+        }
+        m_change_version++;
+        m_table_versions[table]++;
+        m_last_write_ms.store(steady_now_ms());
+        request_wrote() = true;
+        written_table() = table;
+    }
+
+    std::string build_list_response(const std::string& action){
+        if(action == "user_list"){
+            return list_user();
+        }
+        else if(action == "role_list"){
+            return list_role();
+        }
+        else if(action == "user_role_list"){
+            return list_user_role();
+        }
+        else if(action == "skill_list"){
+            return list_skill();
+        }
+        return get_user_creation_pop_up_details();
+    }
+
+    response_cache::payload_ptr refresh_cached_response(std::string action){
+        /*
+        Function to rebuild the response of a list action from the database
+        and cache it unless a write raced with the query
+        return: the rebuilt response
+        */
+        uint64_t version = current_change_version();
+
+        // the cache is shared and a stale entry would be served to everyone
+        // until the next write, so refill it from the primary until every
+        // replica still eligible for reads must have applied the latest write
+        bool pinned = read_from_primary();
+        if(steady_now_ms() - m_last_write_ms.load() < m_cache_pin_after_write_ms){
+            read_from_primary() = true;
+        }
+        read_failed() = false;
+        response_cache::payload_ptr payload(new std::string(build_list_response(action)));
+        read_from_primary() = pinned;
+
+        if(read_failed()){
+            // never cache or serve a list that is missing rows
+            LOG_WARNING("list read failed for " << action);
+            read_failed() = false;
+            return response_cache::payload_ptr(new std::string(
+                "{\"action\":\""+action+"\", \"status\":\"False\", \"error\":\"database\"}"));
+        }
+
+        lock_guard<mutex> guard(m_change_lock);
+        if(version == m_change_version){
+            m_response_cache.put(action, payload);
+        }
+        return payload;
+    }
+
+    response_cache::payload_ptr cached_response(const std::string& action){
+        /*
+        Function to serve a list or drop-down action from the response cache.
+        On a miss, concurrent requests for the same action share one database
+        query; the flight key includes the change version so a request never
+        joins a query that started before a write it has already seen.
+        */
+        response_cache::payload_ptr cached = m_response_cache.get(action);
+        if(cached){
+            return cached;
+        }
+        std::string key = action + "@" + std::to_string(current_change_version());
+        response_cache::payload_ptr payload = m_single_flight.run(key, bind(&broadcast_server::refresh_cached_response,this,action));
+        if(!payload){
+            // the request running the shared query hit its deadline
+            throw deadline_exceeded();
+        }
+        return payload;
+    }
+
+    bool load_snapshot(){
+        /*
+        Function to warm the response cache and the in-memory indexes from
+        the snapshot file written by a previous run
+        return: true when a valid snapshot was loaded
+        */
+        snapshot_data data;
+        if(!cache_snapshot::read(m_snapshot_path, data)){
+            return false;
+        }
+        {
+            lock_guard<mutex> guard(m_change_lock);
+            m_change_version = data.change_version;
+        }
+        for(size_t i=0; i<data.payloads.size(); i++){
+            if(snapshot_payload(data.payloads[i][0])){
+                m_response_cache.put(data.payloads[i][0], data.payloads[i][1]);
+            }
+        }
+        install_user_indexes(data.users, current_table_version("user_account"));
+        install_role_membership_index(data.roles, data.user_roles, current_table_version("roles") + current_table_version("user_role"));
+        LOG_INFO("Warm start from " << m_snapshot_path << ": " << data.users.size() << " users, "
+            << data.roles.size() << " roles, " << data.user_roles.size() << " user roles");
+        return true;
+    }
+
+    static bool snapshot_payload(const std::string& action){
+        // user_list carries the password column, keep it off the disk
+        return action != "user_list";
+    }
+
+    void write_snapshot(){
+        /*
+        Function to write the response cache and the index tables to the
+        snapshot file when anything changed since the last snapshot
+        */
+        snapshot_data data;
+        {
+            lock_guard<mutex> guard(m_change_lock);
+            if(m_change_version == m_snapshot_version && m_snapshot_written){
+                return;
+            }
+            data.change_version = m_change_version;
+
+            std::map<std::string, response_cache::payload_ptr> payloads = m_response_cache.entries();
+            for(std::map<std::string, response_cache::payload_ptr>::const_iterator it = payloads.begin(); it != payloads.end(); ++it){
+                if(!snapshot_payload(it->first)){
+                    continue;
+                }
+                snapshot_data::record record;
+                record.push_back(it->first);
+                record.push_back(*it->second);
+                data.payloads.push_back(record);
+            }
+
+            std::vector<user_search_entry> users = m_user_search_index.entries();
+            for(size_t i=0; i<users.size(); i++){
+                snapshot_data::record record;
+                record.push_back(users[i].user_id);
+                record.push_back(users[i].username);
+                record.push_back(users[i].firstname);
+                record.push_back(users[i].lastname);
+                record.push_back(m_org_chart_index.supervisor_of(users[i].user_id));
+                data.users.push_back(record);
+            }
+
+            std::map<std::string, role_period> roles = m_role_membership_index.roles();
+            for(std::map<std::string, role_period>::const_iterator it = roles.begin(); it != roles.end(); ++it){
+                snapshot_data::record record;
+                record.push_back(it->first);
+                record.push_back(it->second.start_date);
+                record.push_back(it->second.end_date);
+                data.roles.push_back(record);
+            }
+
+            std::vector<role_assignment> assignments = m_role_membership_index.assignments();
+            for(size_t i=0; i<assignments.size(); i++){
+                snapshot_data::record record;
+                record.push_back(assignments[i].user_role_id);
+                record.push_back(assignments[i].role_id);
+                record.push_back(assignments[i].user_id);
+                record.push_back(assignments[i].start_date);
+                record.push_back(assignments[i].end_date);
+                data.user_roles.push_back(record);
+            }
+        }
+
+        if(cache_snapshot::write(m_snapshot_path, data)){
+            lock_guard<mutex> guard(m_change_lock);
+            m_snapshot_version = data.change_version;
+            m_snapshot_written = true;
+        }
+        else{
+            LOG_ERROR("could not write snapshot " << m_snapshot_path);
+        }
+    }
+
+    void deadline_watchdog_loop(){
+        m_deadlines.run(m_db);
+    }
+
+    void replica_monitor_loop(){
+        if(m_db.has_replicas()){
+            m_db.monitor_loop();
+        }
+    }
+
+    void snapshot_loop(){
+        // periodically persist the caches for the next warm start
+        while(1){
+            std::this_thread::sleep_for(std::chrono::seconds(m_snapshot_interval_s));
+            write_snapshot();
+        }
+    }
+
+    static void retry_with_backoff(websocketpp::lib::function<bool()> load, const char* name){
+        long delay_ms = 100;
+        while(!load()){
+            LOG_WARNING("reloading " << name << " in " << delay_ms << "ms");
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+            delay_ms = std::min(delay_ms * 2, 30000L);
+        }
+    }
+
+    void index_refresh_loop(){
+        /*
+        Function to reload the indexes every m_index_refresh_s seconds, so
+        writes made by other server instances or directly in SQL reach
+        search, org chart and role queries too (0 disables)
+        */
+        while(m_index_refresh_s > 0){
+            std::this_thread::sleep_for(std::chrono::seconds(m_index_refresh_s));
+            retry_with_backoff(bind(&broadcast_server::load_user_indexes,this), "user indexes");
+            retry_with_backoff(bind(&broadcast_server::load_role_membership_index,this), "role membership index");
+        }
+    }
+
+    void reconcile_with_database(){
+        /*
+        Function run in the background after a warm start to replace the
+        snapshot contents with the current database state. Each load is
+        retried with a growing delay while it fails or writes to its tables
+        keep racing with it.
+        */
+        retry_with_backoff(bind(&broadcast_server::load_user_indexes,this), "user indexes");
+        retry_with_backoff(bind(&broadcast_server::load_role_membership_index,this), "role membership index");
+
+        std::map<std::string, response_cache::payload_ptr> payloads = m_response_cache.entries();
+        for(std::map<std::string, response_cache::payload_ptr>::const_iterator it = payloads.begin(); it != payloads.end(); ++it){
+            // entries invalidated by a racing write are rebuilt on the next request
+            refresh_cached_response(it->first);
+        }
+        LOG_INFO("Snapshot reconciled with the database");
+    }
+
+    response_cache::payload_ptr compare_and_perform_action(const rapidjson::Document& parsed_response_json, connection_hdl hdl){
         /*
         Function to compare the incoming action and perform this action along with 
         the parsed response data passed.
         param parsed_response_json: Document object which has the response ( in json format )
-        return:
+        param hdl: connection the request came from
+        return: the serialized response, shared with other requests when it
+        came from the response cache
         */
         std::string action = parsed_response_json["action"].GetString();
         std::string message = "";
+        response_cache::payload_ptr shared_response;
+
+        // read your own writes: stay on the primary for a while after a write
+        read_from_primary() = m_connections.wrote_within(hdl, m_pin_after_write_ms);
+        request_wrote() = false;
         
         if(action == "log_in"){
             // Get username and get password 
             std::string username = std::string(parsed_response_json["username"].GetString());
             std::string password = std::string(parsed_response_json["password"].GetString());
 
-            message = log_in(username,password);        
+            std::string session_token;
+            message = log_in(username,password,session_token);
+            if(!session_token.empty()){
+                m_connections.set_session(hdl, session_token);
+            }
         }
 
         else if(action == "user_create"){
@@ -812,7 +4384,26 @@ public:
         }
 
         else if(action == "user_list"){
-            message = list_user();
+            shared_response = cached_response("user_list");
+        }
+
+        else if(action == "user_search"){
+            std::string search_query = std::string(parsed_response_json["query"].GetString());
+            unsigned long limit = 10;
+            if(parsed_response_json.HasMember("limit") &&
+               !parse_unsigned(parsed_response_json["limit"], 100, limit)){
+                message = "{\"action\":\"user_search\", \"status\":\"False\"}";
+            }
+            else{
+                message = search_user(search_query, limit);
+            }
+        }
+
+        else if(action == "user_direct_reports" || action == "user_all_reports" ||
+                action == "user_management_chain" || action == "user_subtree_size"){
+            std::string user_id = std::string(parsed_response_json["user_id"].GetString());
+
+            message = user_hierarchy(action, user_id);
         }
 
         else if(action == "role_create"){
@@ -842,7 +4433,7 @@ public:
         }
 
         else if(action == "role_list"){
-            message = list_role();
+            shared_response = cached_response("role_list");
         }
 
         else if(action == "user_role_create"){
@@ -872,7 +4463,27 @@ public:
         }
 
         else if(action == "user_role_list"){
-            message = list_user_role();
+            shared_response = cached_response("user_role_list");
+        }
+
+        else if(action == "user_active_roles"){
+            std::string user_id = std::string(parsed_response_json["user_id"].GetString());
+            std::string date = "";
+            if(parsed_response_json.HasMember("date")){
+                date = std::string(parsed_response_json["date"].GetString());
+            }
+
+            message = user_active_roles(user_id, date);
+        }
+
+        else if(action == "role_active_users"){
+            std::string role_id = std::string(parsed_response_json["role_id"].GetString());
+            std::string date = "";
+            if(parsed_response_json.HasMember("date")){
+                date = std::string(parsed_response_json["date"].GetString());
+            }
+
+            message = role_active_users(role_id, date);
         }
 
          else if(action == "skill_create"){
@@ -896,14 +4507,60 @@ public:
         }
 
         else if(action == "skill_list"){
-            message = list_skill();
+            shared_response = cached_response("skill_list");
+        }
+
+        else if(action == "trace_dump"){
+            std::string format = "chrome";
+            if(parsed_response_json.HasMember("format")){
+                format = std::string(parsed_response_json["format"].GetString());
+            }
+
+            message = dump_trace(format);
+        }
+
+        else if(action == "trace_sample_rate"){
+            // 0 disables tracing, N traces one request in N
+            unsigned long sample_rate;
+            if(!parsed_response_json.HasMember("sample_rate") ||
+               !parse_unsigned(parsed_response_json["sample_rate"], 1000000, sample_rate)){
+                message = "{\"action\":\"trace_sample_rate\", \"status\":\"False\"}";
+            }
+            else{
+                m_tracer.set_sample_rate(sample_rate);
+                message = "{\"action\":\"trace_sample_rate\", \"sample_rate\":\""+std::to_string(m_tracer.sample_rate())+"\"}";
+            }
         }
 
         else if(action == "get_user_creation_pop_up_details"){
             // Call the function to get neccessary information to populate drop downs.
-            message = get_user_creation_pop_up_details();
+            shared_response = cached_response("get_user_creation_pop_up_details");
+        }
+
+        else if(action == "single_flight_stats"){
+            message = "{\"action\":\"single_flight_stats\", \"executed\":\""+std::to_string(m_single_flight.executed())+
+                "\", \"coalesced\":\""+std::to_string(m_single_flight.coalesced())+"\"}";
+        }
+
+        else if(action == "deadline_stats"){
+            std::map<std::string, uint64_t> hits = m_deadlines.hits();
+            message = "{\"action\":\"deadline_stats\", \"hits\":{";
+            for(std::map<std::string, uint64_t>::const_iterator it = hits.begin(); it != hits.end(); ++it){
+                message += (it == hits.begin() ? "\"" : ", \"") + it->first + "\":\"" + std::to_string(it->second) + "\"";
+            }
+            message += "}}";
+        }
+
+        else if(action == "outbound_stats"){
+            message = "{\"action\":\"outbound_stats\", \"dropped_notifications\":\""+std::to_string(m_dropped_notifications.load())+
+                "\", \"slow_consumer_disconnects\":\""+std::to_string(m_slow_consumer_disconnects.load())+"\"}";
+        }
+
+        if(request_wrote()){
+            finish_write(hdl);
         }
-        return message;
+        read_from_primary() = false;
+        return shared_response ? shared_response : response_cache::payload_ptr(new std::string(message));
     }
 
 
@@ -937,30 +4594,104 @@ public:
         parsed_json.Parse(json_string);
         return parsed_json;
     }
-    private:typedef std::set<connection_hdl,std::owner_less<connection_hdl> > con_list;
-
+    private:
     server m_server;
-    con_list m_connections;
+    connection_registry m_connections;
+    user_search_index m_user_search_index;
+    org_chart_index m_org_chart_index;
+    role_membership_index m_role_membership_index;
     std::queue<action> m_actions;
-
     mutex m_action_lock;
-    mutex m_connection_lock;
     condition_variable m_action_cond;
+    long m_worker_count;
+    row_locks m_row_locks;
+    long m_heartbeat_interval_ms;
+    long m_idle_timeout_s;
+    size_t m_send_soft_limit;
+    size_t m_send_hard_limit;
+    std::atomic<uint64_t> m_dropped_notifications;
+    std::atomic<uint64_t> m_slow_consumer_disconnects;
+    long m_change_notify_ms;
+    std::set<std::string> m_changed_tables;
+    mutex m_notify_lock;
+    long m_max_exports;
+    std::atomic<long> m_active_exports;
+    long m_handshake_timeout_ms;
+    std::set<connection_hdl, std::owner_less<connection_hdl> > m_exporting;
+    mutex m_exports_lock;
+
+    long m_io_threads;
+#ifdef WS_TLS
+    context_ptr m_tls_context;
+#endif
+
+    db_router m_db;
+    deadline_watchdog m_deadlines;
+    long m_pin_after_write_ms;
+    long m_cache_pin_after_write_ms;
+    std::atomic<int64_t> m_last_write_ms;
+
+    request_tracer m_tracer;
+    single_flight m_single_flight;
+    std::string m_trace_path;
+
+    response_cache m_response_cache;
+    mutex m_change_lock;
+    uint64_t m_change_version;
+    std::map<std::string, uint64_t> m_table_versions;
+    long m_index_refresh_s;
+    uint64_t m_snapshot_version;
+    bool m_snapshot_written;
+    std::string m_snapshot_path;
+    long m_snapshot_interval_s;
 };
 
 int main() {
+    // libmysqlclient must be initialized before threads call mysql_init
+    if (mysql_library_init(0, NULL, NULL) != 0) {
+        LOG_ERROR("could not initialize the MySQL client library");
+        return 1;
+    }
+
     try {
     broadcast_server server_instance;
+    server_instance.warm_start();
+
+    // Start the worker threads that run the processing loop
+    std::vector<thread> workers;
+    for (size_t i = 0; i < server_instance.worker_count(); i++) {
+        workers.push_back(thread(bind(&broadcast_server::process_messages,&server_instance)));
+    }
+
+    // Start a thread to cancel actions that run past their deadline
+    thread watchdog(bind(&broadcast_server::deadline_watchdog_loop,&server_instance));
+    watchdog.detach();
 
-    // Start a thread to run the processing loop
-    thread t(bind(&broadcast_server::process_messages,&server_instance));
+    // Start a thread to track replica lag for read routing
+    thread replica_monitor(bind(&broadcast_server::replica_monitor_loop,&server_instance));
+    replica_monitor.detach();
 
-    // Run the asio loop with the main thread
+    // Start a thread to pick up writes made outside this server
+    thread index_refresh(bind(&broadcast_server::index_refresh_loop,&server_instance));
+    index_refresh.detach();
+
+    // Start a thread to persist the caches for the next warm start
+    thread snapshot(bind(&broadcast_server::snapshot_loop,&server_instance));
+    snapshot.detach();
+
+    // Start a thread to send batched change notifications
+    thread change_notifier(bind(&broadcast_server::change_notifier_loop,&server_instance));
+    change_notifier.detach();
+
+    // Run the asio loop with the main thread and the other io threads
     server_instance.run(9002);
 
-    t.join();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
 
     } catch (websocketpp::exception const & e) {
-        std::cout << e.what() << std::endl;
+        LOG_ERROR(e.what());
     }
+    mysql_library_end();
 }
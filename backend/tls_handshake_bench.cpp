@@ -0,0 +1,145 @@
+// Measures TLS handshake rates against the wss:// endpoint of server.cpp
+// (built with -DWS_TLS): first with a full handshake on every connection,
+// then resuming the session of the previous connection.
+//
+//   g++ -std=c++11 tls_handshake_bench.cpp -o tls_handshake_bench -lssl -lcrypto
+//   ./tls_handshake_bench [host] [port] [connections] [tls1.2]
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct bench_result {
+    long connections;
+    long resumed;
+    long failed;
+    double handshake_seconds;
+};
+
+int connect_tcp(const std::string& host, const std::string& port){
+    /*
+    Function to open a blocking TCP connection
+    return: socket descriptor, -1 on failure
+    */
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = NULL;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0){
+        return -1;
+    }
+    int fd = -1;
+    for(addrinfo* address = addresses; address != NULL; address = address->ai_next){
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if(fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) == 0){
+            break;
+        }
+        if(fd >= 0){
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+bench_result run_bench(SSL_CTX* ctx, const std::string& host, const std::string& port, long connections, bool resume){
+    /*
+    Function to open connections one after another and time only the
+    handshakes. Each connection sends a plain HTTP request and reads the
+    reply before closing, so TLS 1.3 session tickets sent after the
+    handshake are received and can be used by the next connection.
+    */
+    bench_result result = {connections, 0, 0, 0};
+    SSL_SESSION* session = NULL;
+    std::string request = "GET /tls_bench HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+
+    for(long i=0; i<connections; i++){
+        int fd = connect_tcp(host, port);
+        if(fd < 0){
+            result.failed++;
+            continue;
+        }
+        SSL* ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        if(resume && session != NULL){
+            SSL_set_session(ssl, session);
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int connected = SSL_connect(ssl);
+        result.handshake_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if(connected != 1){
+            result.failed++;
+            ERR_print_errors_fp(stderr);
+        }
+        else{
+            if(SSL_session_reused(ssl)){
+                result.resumed++;
+            }
+            SSL_write(ssl, request.data(), request.size());
+            char buffer[4096];
+            while(SSL_read(ssl, buffer, sizeof(buffer)) > 0){
+            }
+            if(resume){
+                if(session != NULL){
+                    SSL_SESSION_free(session);
+                }
+                session = SSL_get1_session(ssl);
+            }
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    if(session != NULL){
+        SSL_SESSION_free(session);
+    }
+    return result;
+}
+
+void print_result(const std::string& name, const bench_result& result){
+    long completed = result.connections - result.failed;
+    double rate = result.handshake_seconds > 0 ? completed / result.handshake_seconds : 0;
+    double mean_ms = completed > 0 ? result.handshake_seconds * 1000 / completed : 0;
+    std::cout << name << ": " << completed << " handshakes, " << result.resumed << " resumed, "
+        << result.failed << " failed, " << rate << " handshakes/s, " << mean_ms << " ms mean" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string host = argc > 1 ? argv[1] : "127.0.0.1";
+    std::string port = argc > 2 ? argv[2] : "9002";
+    long connections = argc > 3 ? std::strtol(argv[3], NULL, 10) : 1000;
+    bool tls12 = argc > 4 && std::string(argv[4]) == "tls1.2";
+
+    SSL_library_init();
+    SSL_load_error_strings();
+    SSL_CTX* ctx = SSL_CTX_new(SSLv23_client_method());
+    // the benchmark only measures handshakes, the server certificate is
+    // usually self signed and is not verified
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+    if(tls12){
+        SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
+#ifdef SSL_OP_NO_TLSv1_3
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1_3);
+#endif
+    }
+
+    print_result("full", run_bench(ctx, host, port, connections, false));
+    print_result("resumed", run_bench(ctx, host, port, connections, true));
+
+    SSL_CTX_free(ctx);
+    return 0;
+}
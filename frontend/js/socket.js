@@ -5,7 +5,10 @@ $( document ).ready(function() {
     $("#registrationPage").hide();
    
     window.WebSocket = window.WebSocket || window.MozWebSocket;
-    var websocket = new WebSocket('ws://127.0.0.1:9002');
+    // Use wss when the page itself came over https, the server then has to
+    // be built with -DWS_TLS
+    var scheme = window.location.protocol == 'https:' ? 'wss://' : 'ws://';
+    var websocket = new WebSocket(scheme + '127.0.0.1:9002');
 
     // Constants to call the Web socket End Point
     var get_user_creation_pop_details = {